@@ -0,0 +1,28 @@
+from ctypes import *
+import sys
+
+# Compares the cost of invoking game logic from the engine through a ctypes callback
+# (GIL acquisition and argument marshalling on every call) with calling a Lua function in-process.
+
+ENG = cdll.LoadLibrary("./libEngine.so")
+ENG.bench_native_callback.restype = c_longlong
+ENG.bench_script_callback.restype = c_longlong
+ENG.script_run.restype = c_bool
+
+def report(name, n, us):
+    print("%-8s %10d calls %10.1f ms %10.1f ns/call" % (name, n, us / 1000, 1000 * us / n))
+
+def main(n):
+    counter = [0]
+    def tick():
+        counter[0] += 1
+    CBFUNC = CFUNCTYPE(None)
+    cb = CBFUNC(tick)
+    ENG.bench_native_callback(cb, 1000)
+    report("ctypes", n, ENG.bench_native_callback(cb, n))
+
+    ENG.script_run(b"counter = 0 function tick() counter = counter + 1 end")
+    ENG.bench_script_callback(b"tick", 1000)
+    report("lua", n, ENG.bench_script_callback(b"tick", n))
+
+main(int(sys.argv[1]) if len(sys.argv) > 1 else 1000000)
@@ -0,0 +1,265 @@
+// Native benchmarks of the engine hot paths. Runs headless from the repository root (for mono.ttf) and
+// prints one JSON document to stdout, progress goes to stderr. An optional argument only runs the
+// benchmarks whose name contains it.
+
+#include "Engine.cpp"
+
+static long long now_ns() { return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+
+struct Benchmark {
+    struct Result {
+        String name;
+        I32 iterations;
+        I32 ops;
+        double min;
+        double median;
+        double mean;
+        double p99;
+        double stddev;
+    };
+
+    String filter;
+    Vector<Result> results;
+
+    bool wanted(const String& name) { return filter.empty() || name.find(filter) != String::npos; }
+
+    // Times f() iterations times after warmup untimed runs. f performs ops operations, results are in ns per operation.
+    template <typename F>
+    void run(const String& name, I32 warmup, I32 iterations, I32 ops, F f) {
+        if (!wanted(name)) {
+            return;
+        }
+        fprintf(stderr, "%s\n", name.c_str());
+        for (I32 i = 0; i < warmup; i++) {
+            f();
+        }
+        Vector<double> samples(iterations);
+        for (I32 i = 0; i < iterations; i++) {
+            long long start = now_ns();
+            f();
+            samples[i] = (double)(now_ns() - start) / ops;
+        }
+        std::sort(samples.begin(), samples.end());
+        double sum = 0;
+        for (double s : samples) sum += s;
+        double mean = sum / iterations;
+        double var = 0;
+        for (double s : samples) var += (s - mean) * (s - mean);
+        Result r = {name, iterations, ops, samples[0], samples[iterations / 2], mean,
+                    samples[(iterations * 99 + 99) / 100 - 1], std::sqrt(var / iterations)};
+        results.push_back(r);
+    }
+
+    void print_json() {
+        printf("{\n  \"unit\": \"ns/op\",\n  \"benchmarks\": [\n");
+        for (size_t i = 0; i < results.size(); i++) {
+            const Result& r = results[i];
+            printf("    {\"name\": \"%s\", \"iterations\": %d, \"ops\": %d, \"min\": %.1f, \"median\": %.1f, \"mean\": %.1f, \"p99\": %.1f, \"stddev\": %.1f}%s\n",
+                   r.name.c_str(), r.iterations, r.ops, r.min, r.median, r.mean, r.p99, r.stddev, i + 1 < results.size() ? "," : "");
+        }
+        printf("  ]\n}\n");
+    }
+};
+
+static const Size SCREEN = {1280, 720};
+static const I16 TILE = 16;
+
+static void register_noise(const char* name, U32 rgba) {
+    texture_gen_noise(name, TILE, TILE, rgba, 0.1f, 1);
+}
+
+// Same configuration as create_map_config() in Game.py.
+static void create_map(I16 map_size) {
+    if (g_ui->tilemap_widget) {
+        vector_remove(g_ui->top_widgets, g_ui->tilemap_widget);
+        delete g_ui->tilemap_widget;
+        delete[] g_ui->tiles_ground;
+        g_ui->tilemap_widget = nullptr;
+    }
+    delete g_ui->map_config;
+    g_ui->map_config = new MapConfig();
+    Widget* w = g_ui->create_tilemap({(I16)(SCREEN.w * 0.7), SCREEN.h}, {map_size, map_size}, {TILE, TILE});
+    add_widget(nullptr, w, SCREEN.w * 0.3, 0);
+    mapconfig_set_parameters(16, 3, 6);
+    mapconfig_add_elevation(0.57);
+    mapconfig_add_biome(0, "water", 100, "", 0, 0, true);
+    mapconfig_add_elevation(0.0175);
+    mapconfig_add_biome(1, "beach", 100, "", 0, 0, false);
+    mapconfig_add_elevation(0.11);
+    mapconfig_add_biome(2, "snow", 30, "", 0, 0, false);
+    mapconfig_add_biome(2, "grass", 70, "", 0, 0, false);
+    mapconfig_add_biome(2, "sand", 100, "", 0, 0, false);
+    mapconfig_add_elevation(0.01);
+    mapconfig_add_biome(3, "earth", 100, "", 0, 0, false);
+    mapconfig_add_elevation(0.2925);
+    mapconfig_add_biome(4, "earth", 100, "mountain_wall", 32, 2, false);
+    random_seed(1);
+}
+
+static void bench_blit(Benchmark& b) {
+    Color* opaque = new Color[TILE * TILE];
+    Color* transparent = new Color[TILE * TILE];
+    for (int i = 0; i < TILE * TILE; i++) {
+        opaque[i] = Color(i, 2 * i, 3 * i, 255);
+        transparent[i] = Color(i, 2 * i, 3 * i, i);
+    }
+    Box canvas(Point(0, 0), SCREEN);
+    for (float zoom : UI::zoom_levels) {
+        Size s(TILE * zoom, TILE * zoom);
+        I32 cols = SCREEN.w / s.w;
+        I32 rows = SCREEN.h / s.h;
+        for (bool alpha : {false, true}) {
+            char name[64];
+            snprintf(name, sizeof(name), "blit/zoom=%g/%s", zoom, alpha ? "transparent" : "opaque");
+            b.run(name, 3, 30, cols * rows, [&]() {
+                for (I32 y = 0; y < rows; y++) {
+                    for (I32 x = 0; x < cols; x++) {
+                        g_ui->blit(alpha ? transparent : opaque, s, TILE, {(I16)(x * s.w), (I16)(y * s.h)}, canvas, alpha, zoom);
+                    }
+                }
+            });
+        }
+    }
+    delete[] opaque;
+    delete[] transparent;
+}
+
+static void bench_tilemap(Benchmark& b) {
+    if (!b.wanted("draw_tilemap")) {
+        return;
+    }
+    create_map(1024);
+    g_ui->randomize_map();
+    struct Path {
+        const char* name;
+        Point step;
+    };
+    const Path paths[] = {{"static", {0, 0}}, {"pan", {8, 0}}, {"diagonal", {8, 8}}};
+    for (int zoom_idx = 0; zoom_idx < (int)size(UI::zoom_levels); zoom_idx++) {
+        for (const Path& path : paths) {
+            g_ui->zoom_idx = zoom_idx;
+            g_ui->zoom = UI::zoom_levels[zoom_idx];
+            g_ui->move_cam_to_tile({512, 512});
+            char name[64];
+            snprintf(name, sizeof(name), "draw_tilemap/zoom=%g/%s", g_ui->zoom, path.name);
+            b.run(name, 5, 60, 1, [&]() {
+                g_ui->move_cam(path.step);
+                g_ui->tick();
+                g_ui->draw_tilemap();
+            });
+        }
+    }
+}
+
+static void bench_mapgen(Benchmark& b) {
+    const struct { I16 size; I32 iterations; } sizes[] = {{256, 10}, {1024, 3}, {4096, 1}};
+    for (auto& s : sizes) {
+        char name[64];
+        snprintf(name, sizeof(name), "randomize_map/%d", s.size);
+        if (!b.wanted(name)) {
+            continue;
+        }
+        create_map(s.size);
+        b.run(name, s.iterations > 1 ? 1 : 0, s.iterations, 1, []() { g_ui->randomize_map(); });
+    }
+}
+
+static void bench_text(Benchmark& b) {
+    if (!std::filesystem::exists("./mono.ttf")) {
+        fprintf(stderr, "set_text skipped, mono.ttf not found\n");
+        return;
+    }
+    String text;
+    for (int i = 0; text.size() < 2000; i++) {
+        text += i % 7 ? "lorem " : "ipsum dolor\n";
+    }
+    for (I16 height : {12, 24}) {
+        Widget w({400, 2000});
+        char name[64];
+        snprintf(name, sizeof(name), "set_text/wrap/%dpx", height);
+        b.run(name, 3, 100, 1, [&]() { g_ui->set_text(&w, text, height, {0, 0}); });
+    }
+}
+
+static void bench_audio(Benchmark& b) {
+    g_audio->open_device();
+    const int frames = g_audio->spec.freq * 20;
+    Audio::AudioFile* file = new Audio::AudioFile();
+    file->spec = g_audio->spec;
+    file->length = frames * 2 * sizeof(I16);
+    I16* samples = new I16[frames * 2];
+    for (int i = 0; i < frames; i++) {
+        samples[2 * i] = samples[2 * i + 1] = 8000 * std::sin(i * 0.05);
+    }
+    file->buffer = (Uint8*)samples;
+    g_audio->audio_files["bench"] = file;
+    Vector<Uint8> out(g_audio->spec.samples * 2 * sizeof(I16));
+    for (int voices : {1, 8, 32, 64}) {
+        char name[64];
+        snprintf(name, sizeof(name), "audio_callback/voices=%d", voices);
+        if (!b.wanted(name)) {
+            continue;
+        }
+        g_audio->stop_wav("bench");
+        for (int i = 0; i < voices; i++) {
+            g_audio->play_wav("bench", false, 0.5f, (i % 3) - 1.0f, 0);
+        }
+        b.run(name, 10, 300, 1, [&]() { audio_callback(g_audio, out.data(), out.size()); });
+    }
+}
+
+static void bench_input(Benchmark& b) {
+    if (!b.wanted("handleInputs")) {
+        return;
+    }
+    const char* keys[] = {"A", "S", "D", "W", "Up", "Down", "Left", "Right", "Space", "Return"};
+    for (const char* key : keys) {
+        bind_key(key, []() {});
+    }
+    for (int i = 0; i < 200; i++) {
+        Widget* w = (Widget*)create_widget(40, 40);
+        add_widget(nullptr, w, (i % 20) * 60, (i / 20) * 60);
+        set_widget_callback(w, []() {});
+        set_widget_hover_callback(w, []() {});
+    }
+    const int FRAMES = 2000;
+    String path = (std::filesystem::temp_directory_path() / "engine_bench_input.rec").string();
+    g_input->start_recording(path);
+    for (int f = 0; f < FRAMES; f++) {
+        Vector<String> pressed;
+        Vector<String> released;
+        pressed.push_back(keys[f % size(keys)]);
+        released.push_back(keys[(f + 5) % size(keys)]);
+        if (f % 4 == 0) {
+            pressed.push_back("MouseLeft");
+        }
+        g_input->replay_mouse = {(I16)((f * 7) % SCREEN.w), (I16)((f * 3) % SCREEN.h)};
+        g_input->record_frame(pressed, released);
+    }
+    g_input->stop_recording();
+    g_input->start_replay(path, false);
+    b.run("handleInputs/replay", 0, FRAMES, 1, []() { g_input->handleInputs(); });
+    g_input->stop_replay();
+    std::filesystem::remove(path);
+}
+
+int main(int argc, char** argv) {
+    init_headless(SCREEN.w, SCREEN.h);
+    register_noise("water", 0xFF2040C0);
+    register_noise("beach", 0xFFE0D090);
+    register_noise("snow", 0xFFF0F0F0);
+    register_noise("grass", 0xFF30A030);
+    register_noise("sand", 0xFFD0B060);
+    register_noise("earth", 0xFF806040);
+    register_noise("mountain_wall", 0xFF504030);
+    Benchmark b;
+    b.filter = argc > 1 ? argv[1] : "";
+    bench_blit(b);
+    bench_tilemap(b);
+    bench_mapgen(b);
+    bench_text(b);
+    bench_audio(b);
+    bench_input(b);
+    b.print_json();
+    return 0;
+}
@@ -1,27 +1,56 @@
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <vector>
 #include <string>
 #include <map>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
 #include <chrono>
 #include <filesystem>
 #include <random>
 #include <algorithm>
+#include <atomic>
+#include <functional>
 #include <utility>
+#include <memory>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #define STB_TRUETYPE_IMPLEMENTATION  // force following include to generate implementation
 #include "extern/stb_truetype.h"
+#define SDEFL_IMPLEMENTATION
+#include "extern/sdefl.h"
+#define SINFL_IMPLEMENTATION
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wunused-function"
+#include "extern/sinfl.h"
+#pragma GCC diagnostic pop
 #include "extern/SDL2/SDL.h"
+#include "extern/lua/lua.h"
+#include "extern/lua/lauxlib.h"
+#include "extern/lua/lualib.h"
+#if defined(__GNUC__) && defined(__x86_64__)
+#define ENGINE_X86_SIMD
+#include <immintrin.h>
+#endif
 
 //
 // Types
 //
 
+using I8 = std::int8_t;
 using U8 = std::uint8_t;
 using I16 = std::int16_t;
+using U16 = std::uint16_t;
 using I32 = std::int32_t;
 using U32 = std::uint32_t;
+using U64 = std::uint64_t;
 using F32 = float;
+using F64 = double;
 using String = std::string;
 template <typename T> using Vector = std::vector<T>;
 template <typename K, typename V> using Map = std::map<K, V>;
@@ -106,32 +135,45 @@ static void print(const std::string& s) { puts(s.c_str()); }
 static void wait(int us) { SDL_Delay(us / 1000); }
 static long long now() { return std::chrono::time_point_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now()).time_since_epoch().count(); }
 
+// SDL_Delay only has millisecond granularity and tends to oversleep, so the last stretch is spun.
+static void wait_until(long long t) {
+    constexpr long long SPIN_US = 1500;
+    long long remaining = t - now();
+    if (remaining > SPIN_US) {
+        wait(remaining - SPIN_US);
+    }
+    while (now() < t) {
+        std::this_thread::yield();
+    }
+}
+
+static unsigned random_seed_value = (unsigned)now();
+static std::default_random_engine random_generator(random_seed_value);
+static unsigned long long random_fast_state = 0;
+
+static void random_seed(unsigned seed) {
+    random_seed_value = seed;
+    random_generator.seed(seed);
+    std::uniform_int_distribution<int> distribution(1, 2147483647);
+    random_fast_state = distribution(random_generator);
+}
+
 static double random_fast() {
-    static unsigned long long r = 0;
-    static bool init = false;
-    if (!init) {
-        unsigned seed = (unsigned)now();
-        auto generator = std::default_random_engine(seed);
-        std::uniform_int_distribution<int> distribution(0, 2147483647);
-        r = distribution(generator);
-        init = true;
+    if (!random_fast_state) {
+        random_seed(random_seed_value);
     }
-    r = (r * 48271) % 2147483648;
-    return (double)r / 2147483648;
+    random_fast_state = (random_fast_state * 48271) % 2147483648;
+    return (double)random_fast_state / 2147483648;
 }
 
 static double random_uniform(double min, double max) {
-    static unsigned seed = (unsigned)now();
-    static std::default_random_engine generator(seed);
     std::uniform_real_distribution<double> distribution(min, max);
-    return distribution(generator);
+    return distribution(random_generator);
 }
 
 static double random_gauss(double mean, double dev) {
-    static unsigned seed = (unsigned)now();
-    static std::default_random_engine generator(seed);
     std::normal_distribution<double> distribution(mean, dev);
-    return distribution(generator);
+    return distribution(random_generator);
 }
 
 
@@ -227,843 +269,4023 @@ void vector_remove(Vector<T>& v, const T& val) {
     v.erase(std::remove(v.begin(), v.end(), val), v.end());
 }
 
+// Fixed-capacity single-producer/single-consumer queue. Neither side ever blocks or allocates.
+template <typename T, size_t N>
+struct RingBuffer {
+    bool push(const T& item) {
+        size_t head = write_pos.load(std::memory_order_relaxed);
+        if (head - read_pos.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        items[head % N] = item;
+        write_pos.store(head + 1, std::memory_order_release);
+        return true;
+    }
 
+    bool pop(T& item) {
+        size_t tail = read_pos.load(std::memory_order_relaxed);
+        if (tail == write_pos.load(std::memory_order_acquire)) {
+            return false;
+        }
+        item = items[tail % N];
+        read_pos.store(tail + 1, std::memory_order_release);
+        return true;
+    }
 
+    size_t write(const T* src, size_t count) {
+        size_t head = write_pos.load(std::memory_order_relaxed);
+        count = std::min(count, N - (head - read_pos.load(std::memory_order_acquire)));
+        size_t first = std::min(count, N - head % N);
+        std::copy_n(src, first, items + head % N);
+        std::copy_n(src + first, count - first, items);
+        write_pos.store(head + count, std::memory_order_release);
+        return count;
+    }
 
-static void audio_callback(void*, Uint8 *stream, int len);
+    size_t read(T* dst, size_t count) {
+        size_t tail = read_pos.load(std::memory_order_relaxed);
+        count = std::min(count, write_pos.load(std::memory_order_acquire) - tail);
+        size_t first = std::min(count, N - tail % N);
+        std::copy_n(items + tail % N, first, dst);
+        std::copy_n(items, count - first, dst + first);
+        read_pos.store(tail + count, std::memory_order_release);
+        return count;
+    }
 
-struct Audio {
-    struct AudioFile {
-        SDL_AudioSpec spec;
-        Uint32 length;
-        Uint8* buffer;
-        int length_remaining = 0;
-        bool loop;
+    size_t free_space() { return N - (write_pos.load(std::memory_order_relaxed) - read_pos.load(std::memory_order_acquire)); }
+
+    T items[N];
+    std::atomic<size_t> write_pos = 0;
+    std::atomic<size_t> read_pos = 0;
+};
+
+
+
+
+//
+// Tracing: zones are recorded into a buffer owned by each thread and exported as Chrome trace events
+//
+
+struct TraceEvent {
+    const char* name;
+    long long start;
+    long long duration;
+};
+
+// Only the owning thread writes, the exporter reads the first count events. A buffer from an older
+// session is reset by its owner on the next write.
+struct TraceBuffer {
+    static inline constexpr size_t CAPACITY = 1 << 16;
+    TraceEvent events[CAPACITY];
+    std::atomic<size_t> count = 0;
+    std::atomic<U32> session = 0;
+    U32 tid = 0;
+    std::atomic<const char*> thread_name = nullptr;
+};
+
+struct Tracer {
+    std::atomic<bool> enabled = false;
+    std::atomic<U32> session = 0;
+    long long session_start = 0;
+    std::mutex lock;
+    Vector<TraceBuffer*> buffers;
+    Vector<TraceBuffer*> spare;
+    static inline thread_local TraceBuffer* local = nullptr;
+    static inline thread_local const char* thread_name = "thread";
+
+    void begin() {
+        session_start = now();
+        session++;
+        enabled = true;
+    }
+
+    void end() { enabled = false; }
+
+    // Buffers are never freed. A thread hands its buffer back on exit, so short-lived threads
+    // reuse the same few buffers. Threads that must not allocate or lock acquire one up front.
+    TraceBuffer* acquire(const char* name) {
+        std::lock_guard<std::mutex> guard(lock);
+        TraceBuffer* b;
+        if (spare.empty()) {
+            b = new TraceBuffer();
+            b->tid = buffers.size() + 1;
+            buffers.push_back(b);
+        } else {
+            b = spare.back();
+            spare.pop_back();
+        }
+        b->thread_name = name;
+        return b;
+    }
+
+    void release(TraceBuffer* b) {
+        std::lock_guard<std::mutex> guard(lock);
+        spare.push_back(b);
+    }
+
+    struct Owner {
+        Tracer* tracer = nullptr;
+        TraceBuffer* buffer = nullptr;
+        ~Owner() {
+            if (buffer) {
+                local = nullptr;
+                tracer->release(buffer);
+            }
+        }
     };
 
-    void load_wav(const String& filepath, const String& name, bool music) {
-        static bool audio_init = false;
-        if (!audio_init) {
-            SDL_AudioSpec want, have;
-            SDL_memset(&want, 0, sizeof(want)); /* or SDL_zero(want) */
-            want.freq = 48000;
-            want.format = audio_format;
-            want.channels = 2;
-            want.samples = 1024;
-            want.callback = audio_callback;
-            dev = SDL_OpenAudioDevice(NULL, 0, &want, &have, SDL_AUDIO_ALLOW_ANY_CHANGE);
-            SDL_PauseAudioDevice(dev, 0);
-            audio_init = true;
+    void record(const char* name, long long start, long long end) {
+        if (!local) {
+            static thread_local Owner owner;
+            owner.tracer = this;
+            owner.buffer = local = acquire(thread_name);
         }
-        AudioFile* handle = new AudioFile();
-        handle->loop = music;
-        SDL_LoadWAV(filepath.c_str(), &handle->spec, &handle->buffer, &handle->length);
-        audio_files[name] = handle;
-    }   
+        U32 current = session.load(std::memory_order_relaxed);
+        if (local->session != current) {
+            local->session = current;
+            local->count.store(0, std::memory_order_relaxed);
+        }
+        size_t i = local->count.load(std::memory_order_relaxed);
+        if (i < TraceBuffer::CAPACITY) {
+            local->events[i] = {name, start, end - start};
+            local->count.store(i + 1, std::memory_order_release);
+        }
+    }
 
-    void play_wav(const String& name, bool) {
-        AudioFile* handle = audio_files[name];
-        if (!handle) {
-            return;
+    bool export_json(const String& path) {
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f) {
+            return false;
+        }
+        Vector<TraceBuffer*> list;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            list = buffers;
         }
-        if (!handle->length_remaining && std::find(queued_audio.begin(), queued_audio.end(), handle) == queued_audio.end()) {
-            handle->length_remaining = handle->length;
-            queued_audio.push_back(handle);
+        fputs("{\"traceEvents\":[\n", f);
+        bool first = true;
+        for (TraceBuffer* b : list) {
+            fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", b->tid, b->thread_name.load());
+            first = false;
+            if (b->session != session) {
+                continue;
+            }
+            size_t n = b->count.load(std::memory_order_acquire);
+            for (size_t i = 0; i < n; i++) {
+                const TraceEvent& e = b->events[i];
+                fprintf(f, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%lld,\"dur\":%lld}", e.name, b->tid, e.start - session_start, e.duration);
+            }
         }
+        fputs("\n]}\n", f);
+        return fclose(f) == 0;
     }
+};
 
-    Map<String, AudioFile*> audio_files;
-    Vector<AudioFile*> queued_audio;
-    SDL_AudioFormat audio_format = AUDIO_S16LSB;
-    SDL_AudioDeviceID dev;   
+static Tracer g_tracer;
+
+// name must be a string literal or otherwise outlive the trace.
+struct TraceZone {
+    TraceZone(const char* n) {
+        if (g_tracer.enabled.load(std::memory_order_relaxed)) {
+            name = n;
+            start = now();
+        }
+    }
+    ~TraceZone() {
+        if (name) {
+            g_tracer.record(name, start, now());
+        }
+    }
+    const char* name = nullptr;
+    long long start = 0;
 };
 
-static Audio* g_audio = nullptr;
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_ZONE(name) TraceZone TRACE_CONCAT(trace_zone_, __LINE__)(name)
 
-static void audio_callback(void*, Uint8 *stream, int len) {
-    SDL_memset(stream, 0, len);
-    Vector<Audio::AudioFile*> remove;
-    Vector<Audio::AudioFile*>& queued_audio = g_audio->queued_audio;
-    for (auto& audio : queued_audio) {
-        unsigned play_len = audio->length_remaining > len ? len : audio->length_remaining;
-        SDL_MixAudioFormat(stream, audio->buffer + audio->length - audio->length_remaining, g_audio->audio_format, play_len, 50);
-        audio->length_remaining -= play_len;
-        if (!audio->length_remaining) {
-            remove.push_back(audio);
-        } 
+
+
+
+// Persistent worker threads. run() executes a task on every worker and on the calling thread and
+// waits for all of them. Calls from a worker or while the pool is busy simply run on the caller.
+struct WorkerPool {
+    WorkerPool() {
+        int n = std::max(1, (int)std::thread::hardware_concurrency() - 1);
+        for (int i = 0; i < n; i++) {
+            threads.emplace_back([this]() { work(); });
+        }
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            quit = true;
+        }
+        wake.notify_all();
+        for (auto& t : threads) t.join();
+    }
+
+    void run(const std::function<void()>& f) {
+        std::unique_lock<std::mutex> busy_guard(busy, std::try_to_lock);
+        if (is_worker || !busy_guard.owns_lock()) {
+            f();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            task = &f;
+            remaining = threads.size();
+            generation++;
+        }
+        wake.notify_all();
+        f();
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait(guard, [this]() { return remaining == 0; });
+        task = nullptr;
     }
-    for (auto& audio : remove) {
-        queued_audio.erase(std::remove(queued_audio.begin(), queued_audio.end(), audio), queued_audio.end());
+
+    int size() { return threads.size() + 1; }
+
+    private:
+    void work() {
+        is_worker = true;
+        Tracer::thread_name = "worker";
+        U32 seen = 0;
+        while (true) {
+            const std::function<void()>* f;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                wake.wait(guard, [&]() { return quit || generation != seen; });
+                if (quit) {
+                    return;
+                }
+                seen = generation;
+                f = task;
+            }
+            (*f)();
+            std::lock_guard<std::mutex> guard(lock);
+            if (--remaining == 0) {
+                done.notify_one();
+            }
+        }
     }
+
+    Vector<std::thread> threads;
+    std::mutex busy;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    const std::function<void()>* task = nullptr;
+    size_t remaining = 0;
+    U32 generation = 0;
+    bool quit = false;
+    static inline thread_local bool is_worker = false;
+};
+
+static WorkerPool& worker_pool() {
+    static WorkerPool pool;
+    return pool;
 }
 
+// Calls f(i) for every i in [begin, end), indices are handed out one at a time to the pool.
+template <typename F>
+static void parallel_for(int begin, int end, F f) {
+    std::atomic<int> next = begin;
+    worker_pool().run([&]() {
+        TRACE_ZONE("parallel_for");
+        for (int i = next++; i < end; i = next++) {
+            f(i);
+        }
+    });
+}
 
 
 
 
+//
+// Asset packs: a header, an index sorted by the FNV-1a hash of each name and the file contents, each
+// entry either stored or deflated. Packs are mmapped and stay mapped until exit, stored entries are used
+// in place and deflated ones are inflated on first use. Names are paths relative to the packed directory.
+//
 
+struct PackEntry {
+    U64 hash;
+    U64 offset;
+    U64 size;
+    U64 raw_size;
+    U32 compression;
+    U32 reserved;
+};
 
-struct Input {
-    struct Listener {
-        public:
-        Listener(void (*f)()): func(f) {}
-        void mouse_clicked(Point) { func(); };
-        void mouse_moved(Point) {};
-        void key_pressed(const std::string& /*key*/) { func(); };
-        //virtual void keyReleased(const std::string& /*key*/) {};
-        void (*func)(); 
-    };
+struct AssetPack {
+    static inline constexpr char MAGIC[4] = {'E', 'P', 'A', 'K'};
+    static inline constexpr U32 VERSION = 1;
+    static inline constexpr U32 ALIGN = 64;
+    enum Compression : U32 { STORED, DEFLATE };
+
+    const U8* base = nullptr;
+    size_t length = 0;
+    const PackEntry* entries = nullptr;
+    U32 count = 0;
+    std::mutex lock;
+    Map<U32, std::unique_ptr<U8[]>> inflated;
+
+    ~AssetPack() {
+        if (base) {
+            munmap((void*)base, length);
+        }
+    }
 
-    void enable() { enabled = true; }
-    void disable() { enabled = false;}
-    void clear_temp_listeners() { clear_temps = true; }
-    void remove_mouse_listener(Listener* l) { remove_list.push_back(l); }
-    void add_key_listeners(Listener* l, const std::vector<std::string>& keys, bool temp = false) {
-        for (auto& key : keys) {
-            if (temp) {
-                temp_presses[key] = l;
-            } else {
-                presses[key] = l;
-            }
+    // "./sounds/click.wav" and "sounds/click.wav" name the same asset.
+    static String normalize(const String& path) {
+        String name = path;
+        std::replace(name.begin(), name.end(), '\\', '/');
+        while (name.compare(0, 2, "./") == 0) {
+            name.erase(0, 2);
         }
+        return name;
     }
-    void add_move_listener(Listener* l) { mouse_moves.push_back(l); }
-    void remove_move_listener(Listener* l) { mouse_moves.erase(std::remove(mouse_moves.begin(), mouse_moves.end(), l), mouse_moves.end()); };
-    void add_mouse_listener(Listener* l, Box b, bool temp = false) {
-        if (temp) {
-            temp_clicks[l] = b;
-        } else { 
-            if (clicks.find(l) == clicks.end()) {
-                clicks[l] = b;
-            } 
+
+    static U64 hash(const String& name) {
+        U64 h = 14695981039346656037ull;
+        for (char c : name) {
+            h = (h ^ (U8)c) * 1099511628211ull;
         }
+        return h;
     }
-    bool shift_held() { return shift_active; }
 
-    void handleInputs() {
-        std::vector<std::string> pressed;
-        std::vector<std::string> released;
-        pressed_keys(pressed, released);
-        for (auto& hold : held) {
-            pressed.push_back(hold.first);
+    bool mount(const String& path) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
         }
-        for (auto& key : pressed) {
-            if (temp_presses.find(key) != temp_presses.end() && !clear_temps) {
-                temp_presses[key]->key_pressed(key);
-            } else if (enabled && presses.find(key) != presses.end()) {
-                presses[key]->key_pressed(key);
-                if (key != "WheelUp" && key != "WheelDown") {
-                    held[key] = 1;
-                }
-            } else if (key == "MouseLeft") {
-                Point p = mouse_pos();
-                Map<Listener*, Box>& active_clicks = enabled ? clicks : temp_clicks;
-                for (auto& click : active_clicks) {
-                    auto& box = click.second;
-                    if (p.x >= box.a.x && p.y >= box.a.y && p.x <= box.b.x && p.y <= box.b.y) {
-                        if (enabled || !clear_temps) {
-                            click.first->mouse_clicked(p);
-                        }
-                    }
-                }
-            }
-            if (key == "Left Shift") {
-                shift_active = true;
+        struct stat st;
+        void* map = fstat(fd, &st) == 0 && st.st_size > 0 ? mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (map == MAP_FAILED) {
+            return false;
+        }
+        base = (const U8*)map;
+        length = st.st_size;
+        U32 header[4] = {};
+        std::memcpy(header, base, std::min(length, sizeof(header)));
+        count = header[2];
+        entries = (const PackEntry*)(base + sizeof(header));
+        bool ok = length >= sizeof(header) && !std::memcmp(header, MAGIC, sizeof(MAGIC)) && header[1] == VERSION &&
+                  count <= (length - sizeof(header)) / sizeof(PackEntry);
+        for (U32 i = 0; ok && i < count; i++) {
+            const PackEntry& e = entries[i];
+            ok = e.offset <= length && e.size <= length - e.offset && (i == 0 || entries[i - 1].hash < e.hash) &&
+                 (e.compression == DEFLATE || (e.compression == STORED && e.size == e.raw_size));
+        }
+        return ok;
+    }
+
+    // Contents of name or nullptr when the pack does not have it.
+    const U8* find(const String& name, size_t& size) {
+        U64 h = hash(normalize(name));
+        const PackEntry* e = std::lower_bound(entries, entries + count, h, [](const PackEntry& e, U64 h) { return e.hash < h; });
+        if (e == entries + count || e->hash != h) {
+            return nullptr;
+        }
+        size = e->raw_size;
+        if (e->compression == STORED) {
+            return base + e->offset;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        std::unique_ptr<U8[]>& data = inflated[e - entries];
+        if (!data) {
+            data.reset(new U8[e->raw_size + 1]);
+            if (sinflate(data.get(), e->raw_size + 1, base + e->offset, e->size) != (int)e->raw_size) {
+                data.reset();
+                return nullptr;
             }
         }
-        for (auto& key : released) {
-            if (key == "Left Shift") {
-                shift_active = false;
+        return data.get();
+    }
+
+    // Packs the files below dir, they are read and compressed in parallel. Entries that deflate to less
+    // than 7/8 of their size are stored deflated, data starts at ALIGN byte boundaries.
+    static bool build(const String& dir, const String& path) {
+        std::error_code error;
+        if (!std::filesystem::is_directory(dir, error)) {
+            return false;
+        }
+        // Hidden files and directories (.git) and the pack itself are left out.
+        Vector<String> names;
+        std::filesystem::path target = std::filesystem::weakly_canonical(path, error);
+        for (const String& file : filelist(dir, "")) {
+            String name = std::filesystem::relative(file, dir, error).generic_string();
+            bool hidden = name[0] == '.' || name.find("/.") != String::npos;
+            if (!hidden && std::filesystem::is_regular_file(file, error) && std::filesystem::weakly_canonical(file, error) != target) {
+                names.push_back(name);
             }
-            held.erase(key);
         }
-        Point current_mouse_pos = mouse_pos();
-        if (enabled && current_mouse_pos != last_mouse_pos) {
-            for (auto& l : mouse_moves) {
-                l->mouse_moved(current_mouse_pos);
+        Vector<PackEntry> index(names.size());
+        Vector<Vector<U8>> blobs(names.size());
+        std::atomic<bool> ok = true;
+        parallel_for(0, names.size(), [&](int i) {
+            static thread_local std::unique_ptr<sdefl> deflate(new sdefl());
+            Vector<U8> raw;
+            FILE* f = fopen((std::filesystem::path(dir) / names[i]).string().c_str(), "rb");
+            if (f) {
+                raw.resize(std::filesystem::file_size(std::filesystem::path(dir) / names[i], error));
+                ok = ok && fread(raw.data(), 1, raw.size(), f) == raw.size() && raw.size() < (1u << 31);
+                fclose(f);
+            } else {
+                ok = false;
+            }
+            PackEntry& e = index[i];
+            e = PackEntry{hash(names[i]), 0, raw.size(), raw.size(), STORED, 0};
+            blobs[i].resize(sdefl_bound(raw.size()));
+            blobs[i].resize(sdeflate(deflate.get(), blobs[i].data(), raw.data(), raw.size(), SDEFL_LVL_DEF));
+            if (blobs[i].size() < raw.size() / 8 * 7) {
+                e.compression = DEFLATE;
+                e.size = blobs[i].size();
+            } else {
+                blobs[i].swap(raw);
+            }
+        });
+        Vector<I32> order(names.size());
+        for (size_t i = 0; i < order.size(); i++) order[i] = i;
+        std::sort(order.begin(), order.end(), [&](I32 a, I32 b) { return index[a].hash < index[b].hash; });
+        for (size_t i = 1; i < order.size(); i++) {
+            if (index[order[i - 1]].hash == index[order[i]].hash) {
+                fprintf(stderr, "asset pack: %s and %s have the same hash\n", names[order[i - 1]].c_str(), names[order[i]].c_str());
+                ok = false;
             }
-            last_mouse_pos = current_mouse_pos; 
         }
-        for (auto l : remove_list) {
-            clicks.erase(l);
+        if (!ok) {
+            return false;
         }
-        remove_list.clear();
-        if (clear_temps) {
-            temp_presses.clear();
-            temp_clicks.clear();
-            clear_temps = false;
+        U32 header[4] = {};
+        std::memcpy(header, MAGIC, sizeof(MAGIC));
+        header[1] = VERSION;
+        header[2] = order.size();
+        U64 offset = sizeof(header) + order.size() * sizeof(PackEntry);
+        Vector<PackEntry> sorted;
+        for (I32 i : order) {
+            offset = (offset + ALIGN - 1) / ALIGN * ALIGN;
+            sorted.push_back(index[i]);
+            sorted.back().offset = offset;
+            offset += index[i].size;
+        }
+        String tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (!f) {
+            return false;
         }
+        ok = fwrite(header, sizeof(header), 1, f) == 1 && fwrite(sorted.data(), sizeof(PackEntry), sorted.size(), f) == sorted.size();
+        static const U8 zeros[ALIGN] = {};
+        for (size_t i = 0; ok && i < order.size(); i++) {
+            size_t pad = sorted[i].offset - ftell(f);
+            const Vector<U8>& blob = blobs[order[i]];
+            ok = fwrite(zeros, 1, pad, f) == pad && fwrite(blob.data(), 1, blob.size(), f) == blob.size();
+        }
+        ok = fclose(f) == 0 && ok;
+        if (ok) {
+            std::filesystem::rename(tmp, path, error);
+        }
+        if (!ok || error) {
+            std::filesystem::remove(tmp, error);
+            return false;
+        }
+        return true;
     }
+};
 
-    void pressed_keys(std::vector<std::string>& pressed, std::vector<std::string>& released) {
-        SDL_Event event;
-        while (SDL_PollEvent(&event)) {
-            switch (event.type) {
-                case SDL_MOUSEWHEEL: {
-                    pressed.push_back(event.wheel.y > 0 ? "WheelUp" : "WheelDown");
-                    break;
-                }
-                case SDL_KEYDOWN: {
-                    pressed.push_back(SDL_GetKeyName(event.key.keysym.sym));
-                    break;
-                }
-                case SDL_KEYUP: {
-                    released.push_back(SDL_GetKeyName(event.key.keysym.sym));
-                    break;
-                }
-                case SDL_MOUSEBUTTONDOWN: {
-                    if (event.button.button == SDL_BUTTON_LEFT) {
-                        pressed.push_back("MouseLeft");
-                    }
-                    break; 
-                }
-                case SDL_WINDOWEVENT: {
-                    switch (event.window.event) {
-                    case SDL_WINDOWEVENT_CLOSE:
-                        exit(0);
-                        break;
-                    default:
-                        break;
-                    }
-                    break;
-                }
-                default:
-                    break;
-            }
+// Asset lookups try the mounted packs, newest first, before the file system.
+struct Assets {
+    Vector<std::unique_ptr<AssetPack>> packs;
+
+    bool mount(const String& path) {
+        std::unique_ptr<AssetPack> pack(new AssetPack());
+        if (!pack->mount(path)) {
+            return false;
         }
-    }   
+        packs.push_back(std::move(pack));
+        return true;
+    }
 
-    Point mouse_pos() {
-        int mx, my;
-        SDL_GetMouseState(&mx, &my);
-        return {mx, my};
+    // Points into a pack or, for loose files, into storage.
+    const U8* read(const String& path, Vector<U8>& storage, size_t& size) {
+        for (auto it = packs.rbegin(); it != packs.rend(); ++it) {
+            if (const U8* data = (*it)->find(path, size)) {
+                return data;
+            }
+        }
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) {
+            return nullptr;
+        }
+        std::error_code error;
+        storage.resize(std::filesystem::file_size(path, error));
+        size = fread(storage.data(), 1, storage.size(), f);
+        fclose(f);
+        return error || size != storage.size() ? nullptr : storage.data();
     }
 
-    Map<std::string, int> held;
-    Vector<Listener*> mouse_moves;
-    Map<std::string, Listener*> temp_presses;
-    Map<std::string, Listener*> presses;
-    Map<Listener*, Box> temp_clicks;
-    Map<Listener*, Box> clicks;
-    Vector<Listener*> remove_list;
-    bool enabled = true;
-    bool clear_temps = false;
-    bool shift_active = false;
-    Point last_mouse_pos;
+    SDL_RWops* open(const String& path) {
+        size_t size;
+        for (auto it = packs.rbegin(); it != packs.rend(); ++it) {
+            if (const U8* data = (*it)->find(path, size)) {
+                return SDL_RWFromConstMem(data, size);
+            }
+        }
+        return SDL_RWFromFile(path.c_str(), "rb");
+    }
 };
 
-static Input* g_input = nullptr;
+static Assets g_assets;
 
 
 
 
+//
+// Profiler: stage times of the last HISTORY frames, recorded by ProfileScope on the main thread
+//
 
+enum ProfileStage : I32 { STAGE_FRAME, STAGE_INPUT, STAGE_WIDGETS, STAGE_TILEMAP, STAGE_TEXT, STAGE_PRESENT, STAGE_MAPGEN, STAGE_COUNT };
 
+struct ProfileStats {
+    F32 last;
+    F32 min;
+    F32 avg;
+    F32 p99;
+    F32 max;
+};
 
+struct Profiler {
+    static inline constexpr I32 HISTORY = 256;
+    static inline constexpr const char* stage_names[STAGE_COUNT] = {"frame", "input", "widgets", "tilemap", "text", "present", "mapgen"};
+    long long current[STAGE_COUNT] = {0};
+    long long history[HISTORY][STAGE_COUNT] = {{0}};
+    I32 frames = 0;
+    std::atomic<I32> autosave_chunks = 0;
+    std::atomic<I32> autosave_chunks_written = 0;
+    std::atomic<bool> autosave_running = false;
+    std::atomic<long long> autosave_us = 0;
+
+    void end_frame(long long frame_us) {
+        current[STAGE_FRAME] = frame_us;
+        std::memcpy(history[frames % HISTORY], current, sizeof(current));
+        std::memset(current, 0, sizeof(current));
+        frames++;
+    }
 
-using TextureID = I16;
+    // In milliseconds, over the recorded frames.
+    ProfileStats stats(I32 stage) {
+        ProfileStats s = {0, 0, 0, 0, 0};
+        I32 n = std::min(frames, HISTORY);
+        if (n == 0 || stage < 0 || stage >= STAGE_COUNT) {
+            return s;
+        }
+        long long samples[HISTORY];
+        long long sum = 0;
+        for (I32 i = 0; i < n; i++) {
+            samples[i] = history[i][stage];
+            sum += samples[i];
+        }
+        std::sort(samples, samples + n);
+        s.last = history[(frames - 1) % HISTORY][stage] / 1000.0f;
+        s.min = samples[0] / 1000.0f;
+        s.avg = sum / (1000.0f * n);
+        s.p99 = samples[(n * 99 + 99) / 100 - 1] / 1000.0f;
+        s.max = samples[n - 1] / 1000.0f;
+        return s;
+    }
+};
 
-struct MapConfig {
-    struct Item {
-        Item(const String& n, double p): name(n), perc(p) {}
-        String name = "";
-        double perc = 0.0;
-        TextureID id = -1;
-        Size size = {0, 0};
-    };
-    
-    struct Biome {
-        Biome(const String& n, const String& nw, I16 mh, I16 wh, bool b): name(n), name_wall(nw), max_height(mh), wall_height(wh), blocking(b) {}
-        String name;
-        String name_wall;
-        I16 max_height;
-        I16 wall_height;
-        bool blocking;
-        TextureID id = -1;
-        Vector<Item> items;
-    };
+static Profiler g_profiler;
 
-    struct Elevation {
-        Elevation(double p): perc(p) {}
+// Stages are exclusive: time spent in a nested scope is only counted for the inner stage.
+struct ProfileScope {
+    ProfileScope(ProfileStage s): zone(Profiler::stage_names[s]), stage(s), parent(open), start(now()) { open = this; }
+    ~ProfileScope() {
+        long long elapsed = now() - start;
+        g_profiler.current[stage] += elapsed - nested;
+        if (parent) {
+            parent->nested += elapsed;
+        }
+        open = parent;
+    }
+    TraceZone zone;
+    ProfileStage stage;
+    ProfileScope* parent;
+    long long start;
+    long long nested = 0;
+    static inline ProfileScope* open = nullptr;
+};
+
+
+
+
+static void audio_callback(void* userdata, Uint8 *stream, int len);
+
+//
+// Mixer kernels, the AVX2 versions are picked at runtime when the cpu supports them
+//
+
+static void mix_stereo(F32* __restrict acc, const I16* __restrict in, int frames, F32 gain_left, F32 gain_right) {
+    for (int i = 0; i < frames; i++) {
+        acc[2 * i] += in[2 * i] * gain_left;
+        acc[2 * i + 1] += in[2 * i + 1] * gain_right;
+    }
+}
+
+static F32 bus_peak(const F32* bus, int samples) {
+    F32 peak = 0.0f;
+    for (int i = 0; i < samples; i++) {
+        peak = std::max(peak, std::abs(bus[i]));
+    }
+    return peak;
+}
+
+// Scales the bus by a gain ramping linearly from gain_from to gain_to per frame and saturates to S16.
+static void bus_to_s16(const F32* bus, I16* out, int frames, F32 gain_from, F32 gain_to) {
+    const F32 step = (gain_to - gain_from) / frames;
+    for (int i = 0; i < frames; i++) {
+        const F32 gain = gain_from + step * i;
+        for (int c = 0; c < 2; c++) {
+            F32 sample = bus[2 * i + c] * gain;
+            out[2 * i + c] = sample > 32767.0f ? 32767 : (sample < -32768.0f ? -32768 : (I16)std::lrint(sample));
+        }
+    }
+}
+
+#ifdef ENGINE_X86_SIMD
+__attribute__((target("avx2,fma")))
+static void mix_stereo_avx2(F32* __restrict acc, const I16* __restrict in, int frames, F32 gain_left, F32 gain_right) {
+    const __m256 gains = _mm256_setr_ps(gain_left, gain_right, gain_left, gain_right, gain_left, gain_right, gain_left, gain_right);
+    int i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        __m256 samples = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(in + 2 * i))));
+        _mm256_storeu_ps(acc + 2 * i, _mm256_fmadd_ps(samples, gains, _mm256_loadu_ps(acc + 2 * i)));
+    }
+    mix_stereo(acc + 2 * i, in + 2 * i, frames - i, gain_left, gain_right);
+}
+
+__attribute__((target("avx2")))
+static F32 bus_peak_avx2(const F32* bus, int samples) {
+    const __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 peak = _mm256_setzero_ps();
+    int i = 0;
+    for (; i + 8 <= samples; i += 8) {
+        peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, _mm256_loadu_ps(bus + i)));
+    }
+    F32 lanes[8];
+    _mm256_storeu_ps(lanes, peak);
+    return std::max(*std::max_element(lanes, lanes + 8), bus_peak(bus + i, samples - i));
+}
+
+__attribute__((target("avx2")))
+static void bus_to_s16_avx2(const F32* bus, I16* out, int frames, F32 gain_from, F32 gain_to) {
+    const F32 step = (gain_to - gain_from) / frames;
+    const __m256 ramp = _mm256_setr_ps(0, 0, 1, 1, 2, 2, 3, 3);
+    const __m256 step8 = _mm256_set1_ps(step);
+    int i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        __m256 gain_lo = _mm256_add_ps(_mm256_set1_ps(gain_from + step * i), _mm256_mul_ps(ramp, step8));
+        __m256 gain_hi = _mm256_add_ps(_mm256_set1_ps(gain_from + step * (i + 4)), _mm256_mul_ps(ramp, step8));
+        __m256i lo = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(bus + 2 * i), gain_lo));
+        __m256i hi = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(bus + 2 * i + 8), gain_hi));
+        _mm256_storeu_si256((__m256i*)(out + 2 * i), _mm256_permute4x64_epi64(_mm256_packs_epi32(lo, hi), 0xD8));
+    }
+    if (i < frames) {
+        bus_to_s16(bus + 2 * i, out + 2 * i, frames - i, gain_from + step * i, gain_to);
+    }
+}
+#endif
+
+struct Audio {
+    struct AudioFile {
+        SDL_AudioSpec spec;
+        Uint32 length;
+        Uint8* buffer;
+    };
+
+    // A track decoded block by block on the streaming thread, the mixer only reads the ring.
+    // The mixer retires a stream it no longer plays, the streaming thread then closes and deletes it.
+    struct MusicStream {
+        static inline constexpr size_t RING_SAMPLES = 1 << 17;
+        SDL_RWops* file = nullptr;
+        SDL_AudioStream* converter = nullptr;
+        Sint64 data_start = 0;
+        Uint32 data_size = 0;
+        Uint32 data_read = 0;
+        bool loop = true;
+        bool input_done = false;
+        std::atomic<bool> eof = false;
+        std::atomic<bool> retired = false;
+        RingBuffer<I16, RING_SAMPLES> ring;
+        ~MusicStream() {
+            if (converter) SDL_FreeAudioStream(converter);
+            if (file) SDL_RWclose(file);
+        }
+    };
+
+    struct MusicVoice {
+        MusicStream* stream = nullptr;
+        F32 gain = 0.0f;
+        F32 step = 0.0f;
+    };
+
+    // Sent from the game thread to the mixer, which owns all playback state.
+    struct Command {
+        enum Type : U8 { PLAY, STOP, PLAY_MUSIC, STOP_MUSIC };
+        Type type = PLAY;
+        AudioFile* file = nullptr;
+        F32 gain = 1.0f;
+        F32 pan = 0.0f;
+        I32 priority = 0;
+        MusicStream* music = nullptr;
+        I32 fade_frames = 0;
+    };
+
+    // One playing instance of a clip, several voices may share the same AudioFile.
+    struct Voice {
+        AudioFile* file = nullptr;
+        Uint32 position = 0;
+        F32 gain_left = 0.0f;
+        F32 gain_right = 0.0f;
+        I32 priority = 0;
+        U32 started = 0;
+    };
+
+    static inline constexpr int MAX_VOICES = 64;
+    static inline constexpr size_t MAX_COMMANDS = 256;
+    static inline constexpr int BUS_FRAMES = 1024;
+    static inline constexpr F32 LIMITER_CEILING = 32000.0f;
+    static inline constexpr F32 LIMITER_RELEASE = 0.05f;
+    static inline constexpr int FADE_STEP_FRAMES = 64;
+    static inline constexpr int STREAM_BLOCK_BYTES = 16384;
+
+    Audio() {
+        #ifdef ENGINE_X86_SIMD
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+            mix_kernel = mix_stereo_avx2;
+            peak_kernel = bus_peak_avx2;
+            output_kernel = bus_to_s16_avx2;
+        }
+        #endif
+    }
+
+    // The mixer only works on interleaved stereo S16, so only the rate may differ from what we ask for.
+    void open_device() {
+        SDL_AudioSpec want;
+        SDL_memset(&want, 0, sizeof(want)); /* or SDL_zero(want) */
+        want.freq = 48000;
+        want.format = audio_format;
+        want.channels = 2;
+        want.samples = 1024;
+        want.callback = audio_callback;
+        want.userdata = this;
+        if (!trace_buffer) {
+            trace_buffer = g_tracer.acquire("audio");
+        }
+        dev = headless ? 0 : SDL_OpenAudioDevice(NULL, 0, &want, &spec, SDL_AUDIO_ALLOW_FREQUENCY_CHANGE | SDL_AUDIO_ALLOW_SAMPLES_CHANGE);
+        if (!dev) {
+            spec = want;
+            return;
+        }
+        SDL_PauseAudioDevice(dev, 0);
+    }
+
+    ~Audio() {
+        streaming = false;
+        if (streamer.joinable()) {
+            streamer.join();
+        }
+    }
+
+    void load_wav(const String& filepath, const String& name, bool music) {
+        if (!spec.freq) {
+            open_device();
+        }
+        if (music) {
+            music_files[name] = filepath;
+            return;
+        }
+        AudioFile* handle = new AudioFile();
+        if (!SDL_LoadWAV_RW(g_assets.open(filepath), 1, &handle->spec, &handle->buffer, &handle->length) || !convert_wav(handle)) {
+            delete handle;
+            return;
+        }
+        audio_files[name] = handle;
+    }   
+
+    // Brings a clip into the device format once so the mixer can add it without any conversion.
+    bool convert_wav(AudioFile* handle) {
+        SDL_AudioCVT cvt;
+        int needed = SDL_BuildAudioCVT(&cvt, handle->spec.format, handle->spec.channels, handle->spec.freq, spec.format, spec.channels, spec.freq);
+        if (needed < 0) {
+            SDL_FreeWAV(handle->buffer);
+            return false;
+        }
+        if (needed > 0) {
+            cvt.len = handle->length;
+            cvt.buf = (Uint8*)SDL_malloc(cvt.len * cvt.len_mult);
+            if (!cvt.buf) {
+                SDL_FreeWAV(handle->buffer);
+                return false;
+            }
+            SDL_memcpy(cvt.buf, handle->buffer, handle->length);
+            SDL_FreeWAV(handle->buffer);
+            if (SDL_ConvertAudio(&cvt) < 0) {
+                SDL_free(cvt.buf);
+                return false;
+            }
+            handle->buffer = cvt.buf;
+            handle->length = cvt.len_cvt;
+        }
+        handle->spec.format = spec.format;
+        handle->spec.channels = spec.channels;
+        handle->spec.freq = spec.freq;
+        handle->length -= handle->length % (spec.channels * sizeof(I16));
+        return true;
+    }
+
+    void play_wav(const String& name, bool, F32 gain = 1.0f, F32 pan = 0.0f, I32 priority = 0) {
+        auto it = audio_files.find(name);
+        if (it != audio_files.end()) {
+            commands.push({Command::PLAY, it->second, gain, pan, priority});
+        }
+    }
+
+    void play_music(const String& name, int fade_ms, bool loop) {
+        auto it = music_files.find(name);
+        if (it == music_files.end()) {
+            return;
+        }
+        MusicStream* stream = open_stream(it->second, loop);
+        if (!stream) {
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(streams_lock);
+            streams.push_back(stream);
+        }
+        if (!streamer.joinable()) {
+            streaming = true;
+            streamer = std::thread([this]() { stream_loop(); });
+        }
+        Command cmd;
+        cmd.type = Command::PLAY_MUSIC;
+        cmd.music = stream;
+        cmd.fade_frames = fade_frames(fade_ms);
+        if (!commands.push(cmd)) {
+            stream->retired = true;
+        }
+    }
+
+    // Computed in 64 bits, fade_ms * freq overflows an int for fades over about 45 seconds at 48 kHz.
+    I32 fade_frames(int fade_ms) { return std::clamp<long long>((long long)fade_ms * spec.freq / 1000, 0, INT32_MAX); }
+
+    void stop_music(int fade_ms) {
+        Command cmd;
+        cmd.type = Command::STOP_MUSIC;
+        cmd.fade_frames = fade_frames(fade_ms);
+        commands.push(cmd);
+    }
+
+    // Finds the fmt and data chunks of a RIFF/WAVE file, the samples themselves are read later by the streaming thread.
+    MusicStream* open_stream(const String& path, bool loop) {
+        SDL_RWops* file = g_assets.open(path);
+        if (!file) {
+            return nullptr;
+        }
+        Uint32 riff = SDL_ReadLE32(file);
+        SDL_ReadLE32(file);
+        Uint32 wave = SDL_ReadLE32(file);
+        SDL_AudioFormat format = 0;
+        Uint16 channels = 0;
+        Uint32 freq = 0;
+        MusicStream* stream = new MusicStream();
+        stream->file = file;
+        stream->loop = loop;
+        while (riff == 0x46464952 && wave == 0x45564157) {
+            Uint32 id = SDL_ReadLE32(file);
+            Uint32 size = SDL_ReadLE32(file);
+            Sint64 start = SDL_RWtell(file);
+            if (size == 0 && id == 0) {
+                break;
+            }
+            if (id == 0x20746d66) { // "fmt "
+                Uint16 tag = SDL_ReadLE16(file);
+                channels = SDL_ReadLE16(file);
+                freq = SDL_ReadLE32(file);
+                SDL_ReadLE32(file);
+                SDL_ReadLE16(file);
+                Uint16 bits = SDL_ReadLE16(file);
+                if (tag == 0xFFFE && size >= 26) {
+                    SDL_ReadLE16(file);
+                    SDL_ReadLE16(file);
+                    SDL_ReadLE32(file);
+                    tag = SDL_ReadLE16(file);
+                }
+                format = tag == 3 && bits == 32 ? AUDIO_F32LSB : (tag != 1 ? 0 : (bits == 8 ? AUDIO_U8 : (bits == 16 ? AUDIO_S16LSB : (bits == 32 ? AUDIO_S32LSB : 0))));
+            } else if (id == 0x61746164) { // "data"
+                stream->data_start = start;
+                stream->data_size = size;
+                break;
+            }
+            if (SDL_RWseek(file, start + size + (size & 1), RW_SEEK_SET) < 0) {
+                break;
+            }
+        }
+        if (format && channels && freq && stream->data_size) {
+            stream->converter = SDL_NewAudioStream(format, channels, freq, spec.format, spec.channels, spec.freq);
+        }
+        if (!stream->converter) {
+            delete stream;
+            return nullptr;
+        }
+        return stream;
+    }
+
+    // Streaming thread: keeps the ring of every active stream topped up and deletes retired streams.
+    void stream_loop() {
+        Tracer::thread_name = "music stream";
+        Vector<Uint8> raw(STREAM_BLOCK_BYTES);
+        Vector<I16> converted(STREAM_BLOCK_BYTES / sizeof(I16));
+        while (streaming) {
+            Vector<MusicStream*> active;
+            {
+                std::lock_guard<std::mutex> lock(streams_lock);
+                for (MusicStream* stream : streams) {
+                    if (stream->retired) {
+                        delete stream;
+                    } else {
+                        active.push_back(stream);
+                    }
+                }
+                streams = active;
+            }
+            for (MusicStream* stream : active) {
+                TRACE_ZONE("fill_stream");
+                fill_stream(stream, raw, converted);
+            }
+            wait(5000);
+        }
+    }
+
+    void fill_stream(MusicStream* stream, Vector<Uint8>& raw, Vector<I16>& converted) {
+        while (!stream->eof && stream->ring.free_space() >= converted.size()) {
+            int n = SDL_AudioStreamGet(stream->converter, converted.data(), converted.size() * sizeof(I16));
+            if (n > 0) {
+                stream->ring.write(converted.data(), n / sizeof(I16));
+            } else if (stream->input_done) {
+                stream->eof = true;
+            } else if (stream->data_read == stream->data_size) {
+                if (stream->loop && stream->data_size) {
+                    SDL_RWseek(stream->file, stream->data_start, RW_SEEK_SET);
+                    stream->data_read = 0;
+                } else {
+                    SDL_AudioStreamFlush(stream->converter);
+                    stream->input_done = true;
+                }
+            } else {
+                size_t want = std::min<size_t>(raw.size(), stream->data_size - stream->data_read);
+                size_t got = SDL_RWread(stream->file, raw.data(), 1, want);
+                stream->data_read = got ? stream->data_read + got : stream->data_size;
+                stream->loop = stream->loop && got;
+                SDL_AudioStreamPut(stream->converter, raw.data(), got);
+            }
+        }
+    }
+
+    void stop_wav(const String& name) {
+        auto it = audio_files.find(name);
+        if (it != audio_files.end()) {
+            commands.push({Command::STOP, it->second});
+        }
+    }
+
+    // Free voice first, otherwise steal the oldest voice of the lowest priority
+    // unless all playing voices are more important than the new sound.
+    Voice* allocate_voice(I32 priority) {
+        Voice* victim = nullptr;
+        for (Voice& v : voices) {
+            if (!v.file) {
+                return &v;
+            }
+            if (!victim || v.priority < victim->priority || (v.priority == victim->priority && v.started < victim->started)) {
+                victim = &v;
+            }
+        }
+        return victim->priority <= priority ? victim : nullptr;
+    }
+
+    // Runs on the audio thread.
+    void mix(Uint8* stream, int len) {
+        Command cmd;
+        while (commands.pop(cmd)) {
+            if (cmd.type == Command::STOP) {
+                for (Voice& v : voices) {
+                    if (v.file == cmd.file) {
+                        v.file = nullptr;
+                    }
+                }
+            } else if (cmd.type == Command::PLAY_MUSIC || cmd.type == Command::STOP_MUSIC) {
+                fade_music(cmd.music, cmd.fade_frames);
+            } else if (Voice* v = allocate_voice(cmd.priority)) {
+                F32 pan = std::clamp(cmd.pan, -1.0f, 1.0f);
+                *v = {cmd.file, 0, cmd.gain * std::min(1.0f, 1.0f - pan), cmd.gain * std::min(1.0f, 1.0f + pan), cmd.priority, voice_serial++};
+            }
+        }
+        I16* out = (I16*)stream;
+        int frames = len / (2 * sizeof(I16));
+        while (frames > 0) {
+            int block = std::min(frames, BUS_FRAMES);
+            std::fill_n(bus, 2 * block, 0.0f);
+            for (Voice& v : voices) {
+                if (v.file) {
+                    mix_voice(v, block);
+                }
+            }
+            for (MusicVoice& m : music) {
+                if (m.stream) {
+                    mix_music(m, block);
+                }
+            }
+            // Peak limiter: pull the gain down to the ceiling within the block, recover slowly afterwards.
+            F32 peak = peak_kernel(bus, 2 * block) * master_gain;
+            F32 target = peak > LIMITER_CEILING ? LIMITER_CEILING / peak : 1.0f;
+            F32 gain = target < limiter_gain ? target : limiter_gain + (target - limiter_gain) * LIMITER_RELEASE;
+            output_kernel(bus, out, block, master_gain * limiter_gain, master_gain * gain);
+            limiter_gain = gain;
+            out += 2 * block;
+            frames -= block;
+        }
+    }
+
+    void mix_voice(Voice& v, int frames) {
+        Uint32 remaining = v.file->length / (2 * sizeof(I16)) - v.position;
+        int n = std::min<Uint32>(remaining, frames);
+        mix_kernel(bus, (const I16*)v.file->buffer + 2 * v.position, n, v.gain_left, v.gain_right);
+        v.position += n;
+        if ((Uint32)n == remaining) {
+            v.file = nullptr;
+        }
+    }
+
+    // The current track fades in on music[0] while the previous one fades out on music[1].
+    void fade_music(MusicStream* next, int fade_frames) {
+        retire_music(music[1]);
+        music[1] = music[0];
+        music[0] = {next, fade_frames > 0 ? 0.0f : 1.0f, fade_frames > 0 ? 1.0f / fade_frames : 0.0f};
+        if (fade_frames > 0) {
+            music[1].step = -1.0f / fade_frames;
+        } else {
+            retire_music(music[1]);
+        }
+        if (!next) {
+            music[0] = {};
+        }
+    }
+
+    void retire_music(MusicVoice& m) {
+        if (m.stream) {
+            m.stream->retired = true;
+        }
+        m = {};
+    }
+
+    void mix_music(MusicVoice& m, int frames) {
+        bool eof = m.stream->eof;
+        int n = m.stream->ring.read(music_scratch, 2 * frames) / 2;
+        for (int i = 0; i < n; i += FADE_STEP_FRAMES) {
+            int len = std::min(FADE_STEP_FRAMES, n - i);
+            mix_kernel(bus + 2 * i, music_scratch + 2 * i, len, m.gain * music_gain, m.gain * music_gain);
+            m.gain = std::clamp(m.gain + m.step * len, 0.0f, 1.0f);
+        }
+        if ((m.step < 0.0f && m.gain <= 0.0f) || (eof && n < frames)) {
+            retire_music(m);
+        }
+    }
+
+    Map<String, AudioFile*> audio_files;
+    Map<String, String> music_files;
+    Vector<MusicStream*> streams;
+    std::mutex streams_lock;
+    std::thread streamer;
+    std::atomic<bool> streaming = false;
+    MusicVoice music[2];
+    I16 music_scratch[2 * BUS_FRAMES];
+    F32 music_gain = 1.0f;
+    RingBuffer<Command, MAX_COMMANDS> commands;
+    Voice voices[MAX_VOICES];
+    U32 voice_serial = 0;
+    F32 bus[2 * BUS_FRAMES];
+    F32 master_gain = 50.0f / SDL_MIX_MAXVOLUME;
+    F32 limiter_gain = 1.0f;
+    void (*mix_kernel)(F32*, const I16*, int, F32, F32) = mix_stereo;
+    F32 (*peak_kernel)(const F32*, int) = bus_peak;
+    void (*output_kernel)(const F32*, I16*, int, F32, F32) = bus_to_s16;
+    SDL_AudioFormat audio_format = AUDIO_S16SYS;
+    SDL_AudioSpec spec = {};
+    SDL_AudioDeviceID dev = 0;
+    TraceBuffer* trace_buffer = nullptr;
+    bool headless = false;
+};
+
+static Audio* g_audio = nullptr;
+
+static void audio_callback(void* userdata, Uint8 *stream, int len) {
+    // The buffer was acquired when the device opened, recording here neither allocates nor locks.
+    if (!Tracer::local) {
+        Tracer::local = ((Audio*)userdata)->trace_buffer;
+    }
+    TRACE_ZONE("mix");
+    ((Audio*)userdata)->mix(stream, len);
+}
+
+
+
+
+
+
+
+struct Input {
+    struct Listener {
+        public:
+        Listener(std::function<void()> f): func(std::move(f)) {}
+        void mouse_clicked(Point) { func(); };
+        void mouse_moved(Point) { func(); };
+        void key_pressed(const std::string& /*key*/) { func(); };
+        //virtual void keyReleased(const std::string& /*key*/) {};
+        std::function<void()> func; 
+    };
+
+    // Uniform grid over the screen, every cell lists the boxes overlapping it.
+    // A lookup only scans the cell under the cursor and returns the topmost box.
+    struct HitGrid {
+        static inline constexpr short CELL_SIZE = 64;
+        enum Kind : U8 { CLICK = 1, HOVER = 2 };
+        struct Entry {
+            Listener* listener = nullptr;
+            Box box;
+            U32 z = 0;
+            U8 kind = 0;
+        };
+
+        HitGrid(Size screen): cols(screen.w / CELL_SIZE + 1), rows(screen.h / CELL_SIZE + 1), cells(cols * rows) {}
+
+        void insert(Listener* l, Box b, U8 kind, I16 depth) {
+            I32 idx;
+            if (free_entries.empty()) {
+                idx = entries.size();
+                entries.emplace_back();
+            } else {
+                idx = free_entries.back();
+                free_entries.pop_back();
+            }
+            entries[idx] = {l, b, ((U32)depth << 20) | (next_seq++ & 0xFFFFF), kind};
+            index[l] = idx;
+            link(idx);
+        }
+
+        void update(Listener* l, Box b, I16 depth) {
+            auto it = index.find(l);
+            if (it == index.end()) {
+                return;
+            }
+            Entry& e = entries[it->second];
+            unlink(it->second);
+            e.box = b;
+            e.z = ((U32)depth << 20) | (e.z & 0xFFFFF);
+            link(it->second);
+        }
+
+        void erase(Listener* l) {
+            auto it = index.find(l);
+            if (it == index.end()) {
+                return;
+            }
+            unlink(it->second);
+            entries[it->second] = Entry();
+            free_entries.push_back(it->second);
+            index.erase(it);
+        }
+
+        void clear() {
+            for (auto& cell : cells) cell.clear();
+            entries.clear();
+            free_entries.clear();
+            index.clear();
+        }
+
+        bool contains(Listener* l) { return index.find(l) != index.end(); }
+
+        Listener* hit(Point p, U8 kind) {
+            Entry* top = nullptr;
+            for (I32 idx : cells[cell(p.y, rows) * cols + cell(p.x, cols)]) {
+                Entry& e = entries[idx];
+                if ((e.kind & kind) && e.box.inside(p) && (!top || e.z > top->z)) {
+                    top = &e;
+                }
+            }
+            return top ? top->listener : nullptr;
+        }
+
+        private:
+        short cell(short v, short n) { return v < 0 ? 0 : (v / CELL_SIZE >= n ? n - 1 : v / CELL_SIZE); }
+
+        template <typename F>
+        void for_cells(Box b, F f) {
+            for (short y = cell(b.a.y, rows); y <= cell(b.b.y, rows); y++) {
+                for (short x = cell(b.a.x, cols); x <= cell(b.b.x, cols); x++) {
+                    f(cells[y * cols + x]);
+                }
+            }
+        }
+
+        void link(I32 idx) { for_cells(entries[idx].box, [&](Vector<I32>& c) { c.push_back(idx); }); }
+        void unlink(I32 idx) { for_cells(entries[idx].box, [&](Vector<I32>& c) { vector_remove(c, idx); }); }
+
+        short cols;
+        short rows;
+        Vector<Vector<I32>> cells;
+        Vector<Entry> entries;
+        Vector<I32> free_entries;
+        Map<Listener*, I32> index;
+        U32 next_seq = 0;
+    };
+
+    Input(Size screen): temp_clicks(screen), clicks(screen) {}
+
+    void enable() { enabled = true; }
+    void disable() { enabled = false;}
+    void clear_temp_listeners() { clear_temps = true; }
+    void remove_mouse_listener(Listener* l) { remove_list.push_back(l); }
+    void add_key_listeners(Listener* l, const std::vector<std::string>& keys, bool temp = false) {
+        for (auto& key : keys) {
+            if (temp) {
+                temp_presses[key] = l;
+            } else {
+                presses[key] = l;
+            }
+        }
+    }
+    void add_move_listener(Listener* l) { mouse_moves.push_back(l); }
+    void remove_move_listener(Listener* l) { mouse_moves.erase(std::remove(mouse_moves.begin(), mouse_moves.end(), l), mouse_moves.end()); };
+    void add_mouse_listener(Listener* l, Box b, bool temp = false, I16 depth = 0) {
+        if (temp) {
+            temp_clicks.erase(l);
+            temp_clicks.insert(l, b, HitGrid::CLICK, depth);
+        } else if (!clicks.contains(l)) {
+            clicks.insert(l, b, HitGrid::CLICK, depth);
+        }
+    }
+    void add_hover_listener(Listener* l, Box b, I16 depth = 0) {
+        if (!clicks.contains(l)) {
+            clicks.insert(l, b, HitGrid::HOVER, depth);
+        }
+    }
+    void move_mouse_listener(Listener* l, Box b, I16 depth) { clicks.update(l, b, depth); }
+    bool shift_held() { return shift_active; }
+
+    void handleInputs() {
+        std::vector<std::string> pressed;
+        std::vector<std::string> released;
+        pressed_keys(pressed, released);
+        if (replay_file) {
+            pressed.clear();
+            released.clear();
+            replay_frame(pressed, released);
+        } else if (record_file) {
+            record_frame(pressed, released);
+        }
+        for (auto& hold : held) {
+            pressed.push_back(hold.first);
+        }
+        for (auto& key : pressed) {
+            if (temp_presses.find(key) != temp_presses.end() && !clear_temps) {
+                temp_presses[key]->key_pressed(key);
+            } else if (enabled && presses.find(key) != presses.end()) {
+                presses[key]->key_pressed(key);
+                if (key != "WheelUp" && key != "WheelDown") {
+                    held[key] = 1;
+                }
+            } else if (key == "MouseLeft") {
+                Point p = mouse_pos();
+                Listener* l = (enabled ? clicks : temp_clicks).hit(p, HitGrid::CLICK);
+                if (l && (enabled || !clear_temps)) {
+                    l->mouse_clicked(p);
+                }
+            }
+            if (key == "Left Shift") {
+                shift_active = true;
+            }
+        }
+        for (auto& key : released) {
+            if (key == "Left Shift") {
+                shift_active = false;
+            }
+            held.erase(key);
+        }
+        Point current_mouse_pos = mouse_pos();
+        if (enabled && current_mouse_pos != last_mouse_pos) {
+            for (auto& l : mouse_moves) {
+                l->mouse_moved(current_mouse_pos);
+            }
+            if (Listener* l = clicks.hit(current_mouse_pos, HitGrid::HOVER)) {
+                l->mouse_moved(current_mouse_pos);
+            }
+            last_mouse_pos = current_mouse_pos; 
+        }
+        for (auto l : remove_list) {
+            clicks.erase(l);
+            delete l;
+        }
+        remove_list.clear();
+        if (clear_temps) {
+            temp_presses.clear();
+            temp_clicks.clear();
+            clear_temps = false;
+        }
+    }
+
+    void pressed_keys(std::vector<std::string>& pressed, std::vector<std::string>& released) {
+        if (headless) {
+            return;
+        }
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            switch (event.type) {
+                case SDL_MOUSEWHEEL: {
+                    pressed.push_back(event.wheel.y > 0 ? "WheelUp" : "WheelDown");
+                    break;
+                }
+                case SDL_KEYDOWN: {
+                    pressed.push_back(SDL_GetKeyName(event.key.keysym.sym));
+                    break;
+                }
+                case SDL_KEYUP: {
+                    released.push_back(SDL_GetKeyName(event.key.keysym.sym));
+                    break;
+                }
+                case SDL_MOUSEBUTTONDOWN: {
+                    if (event.button.button == SDL_BUTTON_LEFT) {
+                        pressed.push_back("MouseLeft");
+                    }
+                    break; 
+                }
+                case SDL_WINDOWEVENT: {
+                    switch (event.window.event) {
+                    case SDL_WINDOWEVENT_CLOSE:
+                        exit(0);
+                        break;
+                    default:
+                        break;
+                    }
+                    break;
+                }
+                default:
+                    break;
+            }
+        }
+    }   
+
+    // Recordings start with a header (magic, version, rng seed) followed by one record per frame:
+    // U16 number of new key names, each as U8 length + chars, then U8 pressed count, U8 released count,
+    // I16 mouse x, I16 mouse y and one U16 key id per pressed and released key.
+    static inline constexpr char RECORD_MAGIC[4] = {'E', 'I', 'N', 'P'};
+    static inline constexpr U32 RECORD_VERSION = 2;
+
+    bool start_recording(const String& path) {
+        stop_recording();
+        record_file = fopen(path.c_str(), "wb");
+        if (!record_file) {
+            return false;
+        }
+        random_seed(random_seed_value);
+        U32 header[2] = {RECORD_VERSION, random_seed_value};
+        fwrite(RECORD_MAGIC, sizeof(RECORD_MAGIC), 1, record_file);
+        fwrite(header, sizeof(header), 1, record_file);
+        return true;
+    }
+
+    void stop_recording() {
+        if (record_file) {
+            fclose(record_file);
+            record_file = nullptr;
+        }
+        record_keys.clear();
+    }
+
+    bool start_replay(const String& path, bool exit_at_end) {
+        stop_replay();
+        replay_file = fopen(path.c_str(), "rb");
+        char magic[4] = {0};
+        U32 header[2] = {0};
+        if (!replay_file || fread(magic, sizeof(magic), 1, replay_file) != 1 || fread(header, sizeof(header), 1, replay_file) != 1 ||
+                std::memcmp(magic, RECORD_MAGIC, sizeof(magic)) || header[0] != RECORD_VERSION) {
+            stop_replay();
+            return false;
+        }
+        random_seed(header[1]);
+        replay_exit = exit_at_end;
+        return true;
+    }
+
+    void stop_replay() {
+        if (replay_file) {
+            fclose(replay_file);
+            replay_file = nullptr;
+        }
+        replay_keys.clear();
+    }
+
+    void record_frame(const Vector<String>& pressed, const Vector<String>& released) {
+        Vector<U8> frame(sizeof(U16), 0);
+        U16 num_keys = 0;
+        auto key_id = [&](const String& key) {
+            auto it = record_keys.find(key);
+            if (it != record_keys.end()) {
+                return it->second;
+            }
+            U16 id = record_keys.size();
+            record_keys[key] = id;
+            num_keys++;
+            frame.push_back(key.size());
+            frame.insert(frame.end(), key.begin(), key.end());
+            return id;
+        };
+        U8 num_pressed = std::min<size_t>(pressed.size(), 255);
+        U8 num_released = std::min<size_t>(released.size(), 255);
+        Vector<U16> ids;
+        for (U8 i = 0; i < num_pressed; i++) ids.push_back(key_id(pressed[i]));
+        for (U8 i = 0; i < num_released; i++) ids.push_back(key_id(released[i]));
+        Point mouse = mouse_pos();
+        I16 state[2] = {mouse.x, mouse.y};
+        frame.push_back(num_pressed);
+        frame.push_back(num_released);
+        frame.insert(frame.end(), (U8*)state, (U8*)state + sizeof(state));
+        frame.insert(frame.end(), (U8*)ids.data(), (U8*)(ids.data() + ids.size()));
+        std::memcpy(frame.data(), &num_keys, sizeof(num_keys));
+        fwrite(frame.data(), frame.size(), 1, record_file);
+    }
+
+    void replay_frame(Vector<String>& pressed, Vector<String>& released) {
+        U16 num_keys = 0;
+        U8 counts[2] = {0};
+        I16 state[2] = {0};
+        bool ok = fread(&num_keys, sizeof(num_keys), 1, replay_file) == 1;
+        for (U16 i = 0; ok && i < num_keys; i++) {
+            U8 len = 0;
+            char name[256];
+            ok = fread(&len, 1, 1, replay_file) == 1 && fread(name, 1, len, replay_file) == len;
+            replay_keys.emplace_back(name, len);
+        }
+        ok = ok && fread(counts, sizeof(counts), 1, replay_file) == 1 && fread(state, sizeof(state), 1, replay_file) == 1;
+        for (int i = 0; ok && i < counts[0] + counts[1]; i++) {
+            U16 id = 0;
+            ok = fread(&id, sizeof(id), 1, replay_file) == 1 && id < replay_keys.size();
+            if (ok) {
+                (i < counts[0] ? pressed : released).push_back(replay_keys[id]);
+            }
+        }
+        if (!ok) {
+            pressed.clear();
+            released.clear();
+            stop_replay();
+            if (replay_exit) {
+                exit(0);
+            }
+            return;
+        }
+        replay_mouse = {state[0], state[1]};
+    }
+
+    Point mouse_pos() {
+        if (replay_file || headless) {
+            return replay_mouse;
+        }
+        int mx, my;
+        SDL_GetMouseState(&mx, &my);
+        return {mx, my};
+    }
+
+    Map<std::string, int> held;
+    Vector<Listener*> mouse_moves;
+    Map<std::string, Listener*> temp_presses;
+    Map<std::string, Listener*> presses;
+    HitGrid temp_clicks;
+    HitGrid clicks;
+    Vector<Listener*> remove_list;
+    bool enabled = true;
+    bool clear_temps = false;
+    bool shift_active = false;
+    Point last_mouse_pos;
+    FILE* record_file = nullptr;
+    Map<String, U16> record_keys;
+    FILE* replay_file = nullptr;
+    Vector<String> replay_keys;
+    Point replay_mouse;
+    bool replay_exit = false;
+    bool headless = false;
+};
+
+static Input* g_input = nullptr;
+
+
+
+
+
+
+
+
+using TextureID = I16;
+
+enum TileLayer : I32 { LAYER_GROUND = 0, LAYER_COUNT };
+
+struct MapConfig {
+    struct Item {
+        Item(const String& n, double p): name(n), perc(p) {}
+        String name = "";
+        double perc = 0.0;
+        TextureID id = -1;
+        Size size = {0, 0};
+    };
+    
+    struct Biome {
+        Biome(const String& n, const String& nw, I16 mh, I16 wh, bool b): name(n), name_wall(nw), max_height(mh), wall_height(wh), blocking(b) {}
+        String name;
+        String name_wall;
+        I16 max_height;
+        I16 wall_height;
+        bool blocking;
+        TextureID id = -1;
+        Vector<Item> items;
+    };
+
+    struct Elevation {
+        Elevation(double p): perc(p) {}
         double perc;
         Vector<Biome> biomes;
         Vector<char> temperatures;
     };
-    
-    Vector<Elevation> elevations;
-    I16 num_cells = 0;
-    I16 sample_factor = 0;
-    I16 sample_distance = 0;
+    
+    Vector<Elevation> elevations;
+    I16 num_cells = 0;
+    I16 sample_factor = 0;
+    I16 sample_distance = 0;
+};
+
+struct Texture {
+    Texture(Color* p, Size s, bool t=false, bool o=true): pixels(p), size(s), stride(s.w), transparent(t), owns_pixels(o) {}
+    Color* pixels = nullptr;
+    Size size;
+    I32 stride;
+    I16 id;
+    bool transparent = false;
+    bool owns_pixels = true;
+    bool in_atlas = false;
+};
+
+enum class PixelFormat : I32 { BGRA8888 = 0, RGBA8888 = 1, RGB888 = 2, BGR888 = 3, GRAY8 = 4 };
+
+static int bytes_per_pixel(PixelFormat format) {
+    switch (format) {
+        case PixelFormat::BGRA8888:
+        case PixelFormat::RGBA8888: return 4;
+        case PixelFormat::RGB888:
+        case PixelFormat::BGR888: return 3;
+        case PixelFormat::GRAY8: return 1;
+    }
+    return 0;
+}
+
+// Texture generators, each row is independent so rows are spread over the worker pool.
+
+static U32 hash32(U32 x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// The four bytes of a hash summed up approximate a normal distribution (mean 510, deviation 147.8), the
+// color channels are then shifted by the same saturated amount like Color::operator+ and operator-.
+static void noise_row(Color* row, int width, U32 first, U32 seed, Color color, F32 scale) {
+    U32* out = (U32*)row;
+    for (int x = 0; x < width; x++) {
+        U32 h = hash32((first + x) ^ seed);
+        int delta = (int)(((int)((h & 0xFF) + ((h >> 8) & 0xFF) + ((h >> 16) & 0xFF) + (h >> 24)) - 510) * scale);
+        U32 up = std::clamp(delta, 0, 255) * 0x010101;
+        U32 down = std::clamp(-delta, 0, 255) * 0x010101;
+        U32 c = unsigned(color);
+        U32 r = c & 0xFF000000;
+        for (int shift = 0; shift < 24; shift += 8) {
+            int v = (int)((c >> shift) & 0xFF) + (int)((up >> shift) & 0xFF) - (int)((down >> shift) & 0xFF);
+            r |= (U32)std::clamp(v, 0, 255) << shift;
+        }
+        out[x] = r;
+    }
+}
+
+#ifdef ENGINE_X86_SIMD
+__attribute__((target("avx2")))
+static void noise_row_avx2(Color* row, int width, U32 first, U32 seed, Color color, F32 scale) {
+    const __m256i lane = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i seeds = _mm256_set1_epi32(seed);
+    const __m256i byte_mask = _mm256_set1_epi32(0xFF);
+    const __m256i rgb = _mm256_set1_epi32(0x010101);
+    const __m256i colors = _mm256_set1_epi32(unsigned(color));
+    const __m256 scales = _mm256_set1_ps(scale);
+    int x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m256i h = _mm256_xor_si256(_mm256_add_epi32(_mm256_set1_epi32(first + x), lane), seeds);
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x7feb352d));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 15));
+        h = _mm256_mullo_epi32(h, _mm256_set1_epi32(0x846ca68b));
+        h = _mm256_xor_si256(h, _mm256_srli_epi32(h, 16));
+        __m256i sum = _mm256_add_epi32(_mm256_add_epi32(_mm256_and_si256(h, byte_mask), _mm256_and_si256(_mm256_srli_epi32(h, 8), byte_mask)),
+                                       _mm256_add_epi32(_mm256_and_si256(_mm256_srli_epi32(h, 16), byte_mask), _mm256_srli_epi32(h, 24)));
+        __m256 centered = _mm256_cvtepi32_ps(_mm256_sub_epi32(sum, _mm256_set1_epi32(510)));
+        __m256i delta = _mm256_cvttps_epi32(_mm256_mul_ps(centered, scales));
+        __m256i up = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(delta, _mm256_setzero_si256()), byte_mask), rgb);
+        __m256i down = _mm256_mullo_epi32(_mm256_min_epi32(_mm256_max_epi32(_mm256_sub_epi32(_mm256_setzero_si256(), delta), _mm256_setzero_si256()), byte_mask), rgb);
+        _mm256_storeu_si256((__m256i*)(row + x), _mm256_subs_epu8(_mm256_adds_epu8(colors, up), down));
+    }
+    noise_row(row + x, width - x, first + x, seed, color, scale);
+}
+#endif
+
+static void generate_noise(Color* pixels, Size size, Color color, F32 variance, U32 seed) {
+    auto kernel = noise_row;
+    #ifdef ENGINE_X86_SIMD
+    if (__builtin_cpu_supports("avx2")) {
+        kernel = noise_row_avx2;
+    }
+    #endif
+    const F32 scale = 255.0f * variance / 147.8f;
+    seed = hash32(seed);
+    parallel_for(0, size.h, [&](int y) {
+        kernel(pixels + y * size.w, size.w, y * size.w, seed, color, scale);
+    });
+}
+
+// Bevelled box: an outer dark rim, a light border and an inner dark rim of border_width pixels in total
+// around a diagonal gradient. Every pixel takes the innermost of its row and column class.
+static void generate_box(Color* pixels, Size size, Color topleft, Color botright, Color border, Color outborder, int border_width) {
+    const F32 d1 = 0.25f * border_width;
+    const F32 d2 = 0.75f * border_width;
+    const int bw = border_width;
+    const double max_dist = size.w + size.h - 2;
+    auto classify = [&](int v, int n) {
+        if (v < d1 || v > n - d1 - 1) return 0;
+        if ((v >= d1 && v <= d2) || v >= n - d2) return 1;
+        if ((v > d2 && v < bw) || (v < n - d2 && v > n - bw - 1)) return 2;
+        return 3;
+    };
+    Vector<U8> column_class(size.w);
+    for (int x = 0; x < size.w; x++) {
+        column_class[x] = classify(x, size.w);
+    }
+    const Color palette[3] = {outborder, border, outborder};
+    parallel_for(0, size.h, [&](int y) {
+        Color* row = pixels + y * size.w;
+        const U8 row_class = classify(y, size.h);
+        for (int x = 0; x < size.w; x++) {
+            U8 c = std::min(row_class, column_class[x]);
+            if (c < 3) {
+                row[x] = palette[c];
+                continue;
+            }
+            double p_topleft = 1 - (x + y) / max_dist;
+            double p_botright = 1 - (size.w - x + size.h + y) / max_dist;
+            auto channel = [&](U8 a, U8 b) { return (U8)std::clamp((int)(p_topleft * a + p_botright * b), 0, 255); };
+            row[x] = Color(channel(topleft.red, botright.red), channel(topleft.green, botright.green), channel(topleft.blue, botright.blue));
+        }
+    });
+}
+
+// Converts one row of pixels in any supported format into the native BGRA layout of Color.
+static void convert_row(const U8* __restrict src, Color* __restrict dst, int width, PixelFormat format) {
+    U32* out = (U32*)dst;
+    switch (format) {
+        case PixelFormat::BGRA8888:
+            std::memcpy(out, src, width * sizeof(U32));
+            break;
+        case PixelFormat::RGBA8888:
+            for (int x = 0; x < width; x++) {
+                U32 v;
+                std::memcpy(&v, src + 4 * x, sizeof(v));
+                out[x] = (v & 0xFF00FF00) | ((v & 0xFF) << 16) | ((v >> 16) & 0xFF);
+            }
+            break;
+        case PixelFormat::RGB888:
+            for (int x = 0; x < width; x++) {
+                out[x] = 0xFF000000 | (src[3 * x] << 16) | (src[3 * x + 1] << 8) | src[3 * x + 2];
+            }
+            break;
+        case PixelFormat::BGR888:
+            for (int x = 0; x < width; x++) {
+                out[x] = 0xFF000000 | (src[3 * x + 2] << 16) | (src[3 * x + 1] << 8) | src[3 * x];
+            }
+            break;
+        case PixelFormat::GRAY8:
+            for (int x = 0; x < width; x++) {
+                out[x] = 0xFF000000 | (src[x] << 16) | (src[x] << 8) | src[x];
+            }
+            break;
+    }
+}
+
+//
+// PNG decoding: gray, gray with alpha, RGB, RGBA and palette images of any bit depth with tRNS
+// transparency. Interlaced images are rejected.
+//
+
+struct Image {
+    std::unique_ptr<Color[]> pixels;
+    Size size;
+};
+
+static U32 read_be32(const U8* p) { return (U32)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+
+static U8 paeth(U8 a, U8 b, U8 c) {
+    int pa = std::abs(b - c);
+    int pb = std::abs(a - c);
+    int pc = std::abs(a + b - 2 * c);
+    return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+}
+
+#ifdef ENGINE_X86_SIMD
+// Avg and paeth depend on the reconstructed pixel to the left, so the SSE2 versions work one pixel at a
+// time with its channels in the lanes.
+static __m128i load_pixel(const U8* p, int bpp) {
+    U32 v = 0;
+    std::memcpy(&v, p, bpp);
+    return _mm_cvtsi32_si128(v);
+}
+
+static void store_pixel(U8* p, __m128i v, int bpp) {
+    U32 x = _mm_cvtsi128_si32(v);
+    std::memcpy(p, &x, bpp);
+}
+
+template <int BPP>
+static void unfilter_avg_sse2(U8* row, const U8* prior, int bytes) {
+    const __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+    for (int i = 0; i < bytes; i += BPP) {
+        __m128i b = load_pixel(prior + i, BPP);
+        __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+        a = _mm_add_epi8(load_pixel(row + i, BPP), avg);
+        store_pixel(row + i, a, BPP);
+    }
+}
+
+static __m128i abs_epi16(__m128i v) { return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v)); }
+
+template <int BPP>
+static void unfilter_paeth_sse2(U8* row, const U8* prior, int bytes) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i a = zero;
+    __m128i c = zero;
+    for (int i = 0; i < bytes; i += BPP) {
+        __m128i b = _mm_unpacklo_epi8(load_pixel(prior + i, BPP), zero);
+        __m128i pa = _mm_sub_epi16(b, c);
+        __m128i pb = _mm_sub_epi16(a, c);
+        __m128i pc = abs_epi16(_mm_add_epi16(pa, pb));
+        pa = abs_epi16(pa);
+        pb = abs_epi16(pb);
+        __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        __m128i use_a = _mm_cmpeq_epi16(pa, smallest);
+        __m128i use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(pb, smallest));
+        __m128i use_c = _mm_andnot_si128(_mm_or_si128(use_a, use_b), _mm_set1_epi16(-1));
+        __m128i nearest = _mm_or_si128(_mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)), _mm_and_si128(use_c, c));
+        __m128i x = _mm_unpacklo_epi8(load_pixel(row + i, BPP), zero);
+        a = _mm_and_si128(_mm_add_epi16(x, nearest), _mm_set1_epi16(0xFF));
+        store_pixel(row + i, _mm_packus_epi16(a, a), BPP);
+        c = b;
+    }
+}
+#endif
+
+// Reverses the filter of one row in place, prior is the reconstructed row above. bpp is at least 1.
+static bool unfilter_row(U8 filter, U8* row, const U8* prior, int bytes, int bpp) {
+    switch (filter) {
+        case 0:
+            return true;
+        case 1:
+            for (int i = bpp; i < bytes; i++) row[i] += row[i - bpp];
+            return true;
+        case 2:
+            for (int i = 0; i < bytes; i++) row[i] += prior[i];
+            return true;
+        case 3:
+            #ifdef ENGINE_X86_SIMD
+            if (bpp == 4) return unfilter_avg_sse2<4>(row, prior, bytes), true;
+            if (bpp == 3) return unfilter_avg_sse2<3>(row, prior, bytes), true;
+            #endif
+            for (int i = 0; i < bpp; i++) row[i] += prior[i] >> 1;
+            for (int i = bpp; i < bytes; i++) row[i] += (row[i - bpp] + prior[i]) >> 1;
+            return true;
+        case 4:
+            #ifdef ENGINE_X86_SIMD
+            if (bpp == 4) return unfilter_paeth_sse2<4>(row, prior, bytes), true;
+            if (bpp == 3) return unfilter_paeth_sse2<3>(row, prior, bytes), true;
+            #endif
+            for (int i = 0; i < bpp; i++) row[i] += prior[i];
+            for (int i = bpp; i < bytes; i++) row[i] += paeth(row[i - bpp], prior[i], prior[i - bpp]);
+            return true;
+    }
+    return false;
+}
+
+// The image data is the zlib stream split over all IDAT chunks, a single chunk is inflated in place.
+static bool decode_png(const U8* data, size_t size, Image& image) {
+    static const U8 SIGNATURE[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+    if (size < sizeof(SIGNATURE) || std::memcmp(data, SIGNATURE, sizeof(SIGNATURE))) {
+        return false;
+    }
+    U32 width = 0;
+    U32 height = 0;
+    U8 depth = 0;
+    U8 color = 0;
+    U8 interlace = 0;
+    U8 palette[256][4] = {};
+    U32 palette_size = 0;
+    I32 key[3] = {-1, -1, -1};
+    Vector<std::pair<const U8*, U32>> idat;
+    for (size_t pos = sizeof(SIGNATURE); pos + 12 <= size;) {
+        U32 length = read_be32(data + pos);
+        const U8* type = data + pos + 4;
+        const U8* body = data + pos + 8;
+        if (length > size - pos - 12) {
+            return false;
+        }
+        if (!std::memcmp(type, "IHDR", 4) && length >= 13) {
+            width = read_be32(body);
+            height = read_be32(body + 4);
+            depth = body[8];
+            color = body[9];
+            interlace = body[12];
+        } else if (!std::memcmp(type, "PLTE", 4)) {
+            palette_size = std::min<U32>(length / 3, 256);
+            for (U32 i = 0; i < palette_size; i++) {
+                palette[i][0] = body[3 * i];
+                palette[i][1] = body[3 * i + 1];
+                palette[i][2] = body[3 * i + 2];
+                palette[i][3] = 255;
+            }
+        } else if (!std::memcmp(type, "tRNS", 4)) {
+            if (color == 3) {
+                for (U32 i = 0; i < std::min<U32>(length, 256); i++) palette[i][3] = body[i];
+            }
+            for (U32 i = 0; (color == 0 || color == 2) && i < length / 2 && i < 3; i++) {
+                key[i] = body[2 * i] << 8 | body[2 * i + 1];
+            }
+        } else if (!std::memcmp(type, "IDAT", 4)) {
+            idat.push_back({body, length});
+        } else if (!std::memcmp(type, "IEND", 4)) {
+            break;
+        }
+        pos += 12 + (size_t)length;
+    }
+
+    const int channels[7] = {1, 0, 3, 1, 2, 0, 4};
+    bool depth_ok = color == 0 ? (depth && depth <= 16 && !(depth & (depth - 1))) :
+                    color == 3 ? (depth && depth <= 8 && !(depth & (depth - 1)) && palette_size) :
+                    (color == 2 || color == 4 || color == 6) && (depth == 8 || depth == 16);
+    if (!depth_ok || interlace || width == 0 || height == 0 || width > 32767 || height > 32767 || idat.empty()) {
+        return false;
+    }
+    int bits = channels[color] * depth;
+    int bpp = std::max(1, bits / 8);
+    size_t row_bytes = ((size_t)width * bits + 7) / 8;
+    size_t raw_size = (row_bytes + 1) * height;
+    if (raw_size > INT32_MAX) {
+        return false;
+    }
+    // sinfl reads a few bytes past the stream, a joined stream gets padding.
+    Vector<U8> joined;
+    const U8* stream = idat[0].first;
+    size_t stream_size = idat[0].second;
+    if (idat.size() > 1) {
+        for (auto& chunk : idat) {
+            joined.insert(joined.end(), chunk.first, chunk.first + chunk.second);
+        }
+        stream_size = joined.size();
+        joined.resize(stream_size + 8);
+        stream = joined.data();
+    }
+    // sinfl stops one byte short of cap on a trailing literal.
+    Vector<U8> raw(raw_size + 1);
+    if (stream_size > INT32_MAX || zsinflate(raw.data(), raw.size(), stream, stream_size) != (int)raw_size) {
+        return false;
+    }
+
+    image.size = Size((I16)width, (I16)height);
+    image.pixels.reset(new Color[width * height]);
+    Vector<U8> zero(row_bytes, 0);
+    Vector<U8> rgba(width * 4);
+    auto sample = [&](const U8* row, U32 i) -> U32 {
+        if (depth == 16) return row[2 * i] << 8 | row[2 * i + 1];
+        if (depth == 8) return row[i];
+        return (row[i * depth / 8] >> (8 - depth - i * depth % 8)) & ((1 << depth) - 1);
+    };
+    auto to8 = [&](U32 v) -> U8 { return depth == 16 ? v >> 8 : (depth == 8 ? v : v * 255 / ((1 << depth) - 1)); };
+    for (U32 y = 0; y < height; y++) {
+        U8* row = &raw[y * (row_bytes + 1)];
+        const U8* prior = y ? row - row_bytes : zero.data();
+        if (!unfilter_row(row[0], row + 1, prior, row_bytes, bpp)) {
+            return false;
+        }
+        row++;
+        Color* out = image.pixels.get() + (size_t)y * width;
+        if (depth == 8 && key[0] < 0 && (color == 0 || color == 2 || color == 6)) {
+            convert_row(row, out, width, color == 0 ? PixelFormat::GRAY8 : (color == 2 ? PixelFormat::RGB888 : PixelFormat::RGBA8888));
+            continue;
+        }
+        for (U32 x = 0; x < width; x++) {
+            U8* p = &rgba[4 * x];
+            if (color == 3) {
+                U32 index = sample(row, x);
+                std::memcpy(p, palette[index < palette_size ? index : 0], 4);
+            } else if (color == 0 || color == 4) {
+                U32 gray = sample(row, x * channels[color]);
+                p[0] = p[1] = p[2] = to8(gray);
+                p[3] = color == 4 ? to8(sample(row, 2 * x + 1)) : ((I32)gray == key[0] ? 0 : 255);
+            } else {
+                U32 c = channels[color];
+                U32 r = sample(row, c * x), g = sample(row, c * x + 1), b = sample(row, c * x + 2);
+                p[0] = to8(r);
+                p[1] = to8(g);
+                p[2] = to8(b);
+                p[3] = color == 6 ? to8(sample(row, 4 * x + 3)) : ((I32)r == key[0] && (I32)g == key[1] && (I32)b == key[2] ? 0 : 255);
+            }
+        }
+        convert_row(rgba.data(), out, width, PixelFormat::RGBA8888);
+    }
+    return true;
+}
+
+//
+// Texture atlas: registered textures are copied into shared pages by a skyline bottom-left packer and
+// become views into them. Pages and the first column of every texture are 64 byte aligned.
+//
+
+struct Skyline {
+    struct Segment {
+        I32 x;
+        I32 y;
+        I32 w;
+    };
+
+    I32 width;
+    I32 height;
+    Vector<Segment> segments;
+
+    Skyline(I32 w, I32 h): width(w), height(h), segments{{0, 0, w}} {}
+
+    // Lowest y a w x h rectangle can take with its left edge on segment i, -1 when it does not fit.
+    I32 fit(size_t i, I32 w, I32 h) {
+        if (segments[i].x + w > width) {
+            return -1;
+        }
+        I32 y = 0;
+        for (I32 left = w; left > 0; left -= segments[i++].w) {
+            y = std::max(y, segments[i].y);
+        }
+        return y + h <= height ? y : -1;
+    }
+
+    bool insert(I32 w, I32 h, I32& x, I32& y) {
+        size_t best = segments.size();
+        for (size_t i = 0; i < segments.size(); i++) {
+            I32 fy = fit(i, w, h);
+            if (fy >= 0 && (best == segments.size() || fy < y || (fy == y && segments[i].w < segments[best].w))) {
+                best = i;
+                y = fy;
+            }
+        }
+        if (best == segments.size()) {
+            return false;
+        }
+        x = segments[best].x;
+        segments.insert(segments.begin() + best, {x, y + h, w});
+        for (size_t i = best + 1; i < segments.size() && segments[i].x < x + w;) {
+            I32 cut = x + w - segments[i].x;
+            if (cut < segments[i].w) {
+                segments[i].x += cut;
+                segments[i].w -= cut;
+                break;
+            }
+            segments.erase(segments.begin() + i);
+        }
+        for (size_t i = 0; i + 1 < segments.size();) {
+            if (segments[i].y == segments[i + 1].y) {
+                segments[i].w += segments[i + 1].w;
+                segments.erase(segments.begin() + i + 1);
+            } else {
+                i++;
+            }
+        }
+        return true;
+    }
+};
+
+struct TextureAtlas {
+    static inline constexpr I32 PAGE_SIZE = 1024;
+    static inline constexpr I32 ALIGN = 64 / sizeof(Color);
+
+    struct PageDeleter {
+        void operator()(Color* page) { std::free(page); }
+    };
+
+    Vector<std::unique_ptr<Color, PageDeleter>> pages;
+
+    // Repacks every texture owning its pixels or already in the atlas, tallest first. Textures larger than
+    // a page and adopted buffers, which their owner may still update, stay where they are. Returns the
+    // number of pages, or -1 with nothing moved when page memory could not be allocated.
+    I32 build(const Vector<Texture*>& textures) {
+        Vector<Texture*> packed;
+        for (Texture* t : textures) {
+            if (t && (t->owns_pixels || t->in_atlas) && t->size.w <= PAGE_SIZE && t->size.h <= PAGE_SIZE) {
+                packed.push_back(t);
+            }
+        }
+        std::stable_sort(packed.begin(), packed.end(), [](Texture* a, Texture* b) {
+            return a->size.h != b->size.h ? a->size.h > b->size.h : a->size.w > b->size.w;
+        });
+        Vector<std::unique_ptr<Color, PageDeleter>> fresh;
+        Vector<Skyline> skylines;
+        Vector<Color*> views(packed.size());
+        for (size_t i = 0; i < packed.size(); i++) {
+            I32 w = (packed[i]->size.w + ALIGN - 1) / ALIGN * ALIGN;
+            I32 x = 0;
+            I32 y = 0;
+            size_t page = 0;
+            while (page < skylines.size() && !skylines[page].insert(w, packed[i]->size.h, x, y)) {
+                page++;
+            }
+            if (page == skylines.size()) {
+                fresh.emplace_back((Color*)std::aligned_alloc(64, PAGE_SIZE * PAGE_SIZE * sizeof(Color)));
+                if (!fresh.back()) {
+                    return -1;
+                }
+                skylines.emplace_back(PAGE_SIZE, PAGE_SIZE);
+                skylines.back().insert(w, packed[i]->size.h, x, y);
+            }
+            views[i] = fresh[page].get() + y * PAGE_SIZE + x;
+        }
+        parallel_for(0, packed.size(), [&](int i) {
+            const Texture* t = packed[i];
+            for (I32 y = 0; y < t->size.h; y++) {
+                std::memcpy((void*)(views[i] + y * PAGE_SIZE), t->pixels + y * t->stride, t->size.w * sizeof(Color));
+            }
+        });
+        for (size_t i = 0; i < packed.size(); i++) {
+            Texture* t = packed[i];
+            if (t->owns_pixels) {
+                delete[] t->pixels;
+            }
+            t->pixels = views[i];
+            t->stride = PAGE_SIZE;
+            t->owns_pixels = false;
+            t->in_atlas = true;
+        }
+        pages = std::move(fresh);
+        return pages.size();
+    }
+};
+
+struct Widget {
+    Widget(Size s): size(s) {}
+    ~Widget() {
+        if (listener) {
+            g_input->remove_mouse_listener(listener);
+        }
+        if (hover_listener) {
+            g_input->remove_mouse_listener(hover_listener);
+        }
+        for (Widget* c : children) delete c;
+    }
+    Size size;
+    Point pos;
+    Texture* texture = nullptr;
+    Widget* parent = nullptr;
+    Vector<Widget*> children;
+    Vector<Vector<Texture*>> letters;
+    Point letters_offset;
+    bool remove = false;
+    Input::Listener* listener = nullptr;
+    Input::Listener* hover_listener = nullptr;
+
+    I16 depth() {
+        I16 d = 0;
+        for (Widget* p = parent; p; p = p->parent) d++;
+        return d;
+    }
+};
+    
+struct Camera {
+    Camera(int a, int b): x(a), y(b) {}
+    Camera(double a, double b): x(a), y(b) {}
+    int x;
+    int y;
+    Camera operator+(const Point& p) { return Camera(x + p.x, y + p.y); }
+    Camera operator-(const Point& p) { return Camera(x - p.x, y - p.y); }
+    Camera operator+(const Camera& p) { return Camera(x - p.x, y - p.y); }
+    Camera operator-(const Camera& p) { return Camera(x - p.x, y - p.y); }
+};
+
+// Copy-on-write view of the tile layers while a save is written in the background. The writer reads a
+// chunk straight from the live layer unless a mutation reached it first and copied it aside.
+struct ChunkSnapshot {
+    enum State : U8 { SHARED, READING, COPIED, DONE };
+
+    void begin(I32 count) {
+        states.reset(new std::atomic<U8>[count]);
+        for (I32 i = 0; i < count; i++) states[i] = SHARED;
+        copies.assign(count, nullptr);
+        active = true;
+    }
+
+    // Main thread, once the writer has been joined.
+    void end() {
+        for (TextureID* c : copies) delete[] c;
+        copies.clear();
+        states.reset();
+        active = false;
+    }
+
+    // Main thread, before chunk i (box b of a layer with the given row stride) is modified.
+    void before_write(I32 i, const TextureID* layer, I32 stride, Box b) {
+        while (true) {
+            U8 state = states[i].load();
+            if (state == COPIED || state == DONE) {
+                return;
+            }
+            if (state == READING) {
+                std::this_thread::yield();
+                continue;
+            }
+            if (!copies[i]) {
+                I16 width = b.b.x - b.a.x;
+                copies[i] = new TextureID[width * (b.b.y - b.a.y)];
+                for (I16 y = b.a.y; y < b.b.y; y++) {
+                    std::copy(layer + y * stride + b.a.x, layer + y * stride + b.b.x, copies[i] + (y - b.a.y) * width);
+                }
+            }
+            U8 expected = SHARED;
+            if (states[i].compare_exchange_strong(expected, COPIED)) {
+                return;
+            }
+        }
+    }
+
+    // Writer thread: the rows of chunk i as they were when the snapshot began, release() must follow.
+    const TextureID* acquire(I32 i, const TextureID* layer, I32 layer_stride, Box b, I32& stride) {
+        U8 expected = SHARED;
+        if (states[i].compare_exchange_strong(expected, READING)) {
+            stride = layer_stride;
+            return layer + b.a.y * layer_stride + b.a.x;
+        }
+        stride = b.b.x - b.a.x;
+        return copies[i];
+    }
+
+    void release(I32 i) { states[i] = DONE; }
+
+    std::unique_ptr<std::atomic<U8>[]> states;
+    Vector<TextureID*> copies;
+    bool active = false;
+};
+
+template<class T, size_t N>
+constexpr size_t size(T (&)[N]) { return N; }
+
+struct UI {    
+    Widget* tilemap_widget = nullptr; 
+    TextureID* tiles_ground = nullptr;
+    Box dirty_tiles;
+    bool has_dirty = false;
+    Size tile_dim = {0, 0};
+    Size map_size = {0, 0};
+    Camera camera_pos = {0, 0};
+    Point move_vector = {0, 0};
+    bool infinite_scrolling = true;
+    static inline constexpr char LETTER_MIN = 32;
+    static inline constexpr char LETTER_MAX = 127;
+    SDL_Window* window = nullptr;
+    Color* pixels;
+    Size size;
+    long long last_update = now();
+    I32 fps = 0;
+    Widget* profiler_overlay = nullptr;
+    ChunkSnapshot snapshot;
+    Vector<U32> chunk_generation;
+    Vector<U32> chunk_saved;
+    Vector<U8> chunk_edited;
+    U32 map_revision = 0;
+    U32 map_seed = 0;
+    bool map_from_seed = false;
+    Vector<Texture*> id_to_texture = {nullptr};
+    Map<String, Texture*> name_to_texture;
+    Vector<Texture*> letter_to_texture[1024];
+    TextureAtlas atlas;
+    int zoom_idx = 3;
+    float zoom = 1.0;
+    constexpr static inline float zoom_levels[6] = {0.125, 0.25, 0.5, 1.0, 2.0, 4.0};
+    Vector<Widget*> top_widgets;
+    MapConfig* map_config = new MapConfig();
+
+    Box visible_tiles() {
+        constexpr short pad = 1;
+        I16 xstart = (camera_pos.x) / (zoom * tile_dim.w) - pad;
+        I16 xend = (camera_pos.x + size.w) / (zoom * tile_dim.w) + pad;
+        I16 ystart = (camera_pos.y) / (zoom * tile_dim.h) - pad;
+        I16 yend = (camera_pos.y + size.h) / (zoom * tile_dim.h) + pad;
+        return {Point(xstart, ystart), Point(xend, yend)};
+    }
+
+    void tick() {
+        if (!tilemap_widget) {
+            return;
+        }
+        if (move_vector.x == move_vector.y) {
+            move_vector.x = sqrt(move_vector.x * move_vector.x + move_vector.y * move_vector.y);
+            move_vector.x = move_vector.y;
+        }
+        camera_pos = camera_pos + move_vector;
+        fix_camera();
+        move_vector = {0, 0};
+    }
+
+    void draw_tilemap() {
+        Box canvas(tilemap_widget->pos, tilemap_widget->size);
+        const Box visible = visible_tiles();
+        const Size tile_size = zoomed_tile_size();
+        for (I16 y = visible.a.y; y <= visible.b.y; y++) {
+            for (I16 x = visible.a.x; x <= visible.b.x; x++) {
+                Point p(x, y, map_size);
+                Point start(tilemap_widget->pos.x - camera_pos.x + x * tile_size.w, tilemap_widget->pos.y - camera_pos.y + y * tile_size.h);
+                TextureID ground_id = tiles_ground[p.y * map_size.w + p.x];
+                Texture* texture_ground = id_to_texture[ground_id < 0 ? -ground_id : ground_id];
+                if (texture_ground) {
+                    blit(texture_ground->pixels, tile_size, texture_ground->stride, start, canvas, false, zoom);
+                }
+            }
+        }
+    }
+
+    void zoomin_cam() {
+        if (++zoom_idx >= sizeof(zoom_levels) / sizeof(*zoom_levels)) {
+            --zoom_idx;
+            return;
+        }
+        camera_pos.x = (camera_pos.x + size.w / 4) * 2;
+        camera_pos.y = (camera_pos.y + size.h / 4) * 2;
+        zoom = zoom_levels[zoom_idx];
+        fix_camera();
+    }
+
+    void zoomout_cam() {
+        if (--zoom_idx < 0) {
+            ++zoom_idx;
+            return;
+        }
+        camera_pos.x = (camera_pos.x - size.w / 2) / 2;
+        camera_pos.y = (camera_pos.y - size.h / 2) / 2;
+        zoom = zoom_levels[zoom_idx];
+        fix_camera();
+    }
+
+    void fix_camera() {
+        Camera camera_max = {(zoom * tile_dim.w) * map_size.w - size.w, (zoom * tile_dim.h) * map_size.h - size.h};
+        if (infinite_scrolling) {
+            while (camera_pos.x <= -camera_max.x) camera_pos.x += (camera_max.x + size.w);
+            while (camera_pos.y <= -camera_max.y) camera_pos.y += (camera_max.y + size.h);
+            while (camera_pos.x >= 2 * camera_max.x) camera_pos.x -= (camera_max.x + size.w);
+            while (camera_pos.y >= 2 * camera_max.y) camera_pos.y -= (camera_max.y + size.h);
+        } else {
+            if (camera_pos.x < 0) camera_pos.x = 0;
+            if (camera_pos.y < 0) camera_pos.y = 0;
+            camera_pos.x = camera_pos.x < camera_max.x ? camera_pos.x : camera_max.x;
+            camera_pos.y = camera_pos.y < camera_max.y ? camera_pos.y : camera_max.y;
+        }
+    }
+
+    void move_cam(Point p) {
+        if ((p.x != 0 && move_vector.x == 0)) {
+            move_vector.x = p.x;
+        } 
+        if ((p.y != 0 && move_vector.y == 0)) {
+            move_vector.y = p.y;
+        }
+    }
+
+    void move_cam_to_tile(Point tile_pos) {
+        camera_pos = {tile_pos.x * tile_dim.w * zoom, tile_pos.y * tile_dim.h * zoom};
+        Box visible = visible_tiles();
+        Camera mid = {zoom * tile_dim.w * (visible.b.x - visible.a.x) / 2, zoom * tile_dim.h * (visible.b.y - visible.a.y) / 2};
+        camera_pos = camera_pos - mid;
+        fix_camera();
+    }
+
+    static int floor_div(int a, int b) { return a >= 0 ? a / b : -((-a + b - 1) / b); }
+
+    Size zoomed_tile_size() { return Size(tile_dim.w * zoom, tile_dim.h * zoom); }
+
+    Point pick_tile(Point screen_pos) {
+        const Size tile_size = zoomed_tile_size();
+        if (!tilemap_widget || tile_size.w <= 0 || tile_size.h <= 0 || !Box(tilemap_widget->pos, tilemap_widget->size).inside(screen_pos)) {
+            return Point(-1, -1);
+        }
+        Point tile(floor_div(camera_pos.x + screen_pos.x - tilemap_widget->pos.x, tile_size.w),
+                   floor_div(camera_pos.y + screen_pos.y - tilemap_widget->pos.y, tile_size.h));
+        if (!infinite_scrolling && (tile.x < 0 || tile.y < 0 || tile.x >= map_size.w || tile.y >= map_size.h)) {
+            return Point(-1, -1);
+        }
+        tile.wrap(map_size);
+        return tile;
+    }
+
+    // Writes the indices (y * map width + x) of all tiles under a screen rectangle to out
+    // and returns how many there are in total, which may exceed capacity.
+    I32 pick_tiles(Box screen_rect, I32* out, I32 capacity) {
+        const Size tile_size = zoomed_tile_size();
+        if (!tilemap_widget || tile_size.w <= 0 || tile_size.h <= 0) {
+            return 0;
+        }
+        Box canvas(tilemap_widget->pos, tilemap_widget->size);
+        int sx0 = std::max<int>(std::min(screen_rect.a.x, screen_rect.b.x), canvas.a.x);
+        int sy0 = std::max<int>(std::min(screen_rect.a.y, screen_rect.b.y), canvas.a.y);
+        int sx1 = std::min<int>(std::max(screen_rect.a.x, screen_rect.b.x), canvas.b.x);
+        int sy1 = std::min<int>(std::max(screen_rect.a.y, screen_rect.b.y), canvas.b.y);
+        if (sx0 > sx1 || sy0 > sy1) {
+            return 0;
+        }
+        int x0 = floor_div(camera_pos.x + sx0 - canvas.a.x, tile_size.w);
+        int y0 = floor_div(camera_pos.y + sy0 - canvas.a.y, tile_size.h);
+        int x1 = floor_div(camera_pos.x + sx1 - canvas.a.x, tile_size.w);
+        int y1 = floor_div(camera_pos.y + sy1 - canvas.a.y, tile_size.h);
+        if (infinite_scrolling) {
+            x1 = std::min(x1, x0 + map_size.w - 1);
+            y1 = std::min(y1, y0 + map_size.h - 1);
+        } else {
+            x0 = std::max(x0, 0);
+            y0 = std::max(y0, 0);
+            x1 = std::min(x1, map_size.w - 1);
+            y1 = std::min(y1, map_size.h - 1);
+            if (x0 > x1 || y0 > y1) {
+                return 0;
+            }
+        }
+        I32 count = 0;
+        for (int y = y0; y <= y1; y++) {
+            int row = (y % map_size.h + map_size.h) % map_size.h * map_size.w;
+            int x = x0;
+            for (; x <= x1 && count < capacity; x++, count++) {
+                out[count] = row + (x % map_size.w + map_size.w) % map_size.w;
+            }
+            count += x1 - x + 1;
+        }
+        return count;
+    }
+
+    Widget* create_tilemap(Size widget_size, Size tilemap_size, Size tile_size) {
+        tilemap_widget = new Widget(widget_size);
+        map_size = tilemap_size;
+        tile_dim = tile_size;
+        tiles_ground = new TextureID[map_size.w * map_size.h];
+        std::memset(tiles_ground, 0, map_size.w * map_size.h * sizeof(TextureID));
+        reset_chunks();
+        return tilemap_widget;
+    }
+
+    TextureID* layer(I32 l) { return l == LAYER_GROUND ? tiles_ground : nullptr; }
+
+    // Per chunk: a generation bumped by every change, the generation last written to a save journal and
+    // whether it differs from the generated base map. Called whenever the base map is replaced.
+    void reset_chunks() {
+        Size grid = chunk_grid();
+        chunk_generation.assign(LAYER_COUNT * grid.w * grid.h, 0);
+        chunk_saved.assign(chunk_generation.size(), 0);
+        chunk_edited.assign(chunk_generation.size(), 0);
+        map_revision++;
+    }
+
+    // Union of all tile rectangles changed since the last take_dirty(), b is exclusive.
+    void mark_dirty(Box r) {
+        if (r.a.x >= r.b.x || r.a.y >= r.b.y) {
+            return;
+        }
+        Size grid = chunk_grid();
+        for (I32 cy = r.a.y / CHUNK_SIZE; cy <= (r.b.y - 1) / CHUNK_SIZE; cy++) {
+            for (I32 cx = r.a.x / CHUNK_SIZE; cx <= (r.b.x - 1) / CHUNK_SIZE; cx++) {
+                I32 chunk = LAYER_GROUND * grid.w * grid.h + cy * grid.w + cx;
+                chunk_generation[chunk]++;
+                chunk_edited[chunk] = 1;
+            }
+        }
+        if (!has_dirty) {
+            dirty_tiles = r;
+            has_dirty = true;
+            return;
+        }
+        dirty_tiles = Box(Point(std::min(dirty_tiles.a.x, r.a.x), std::min(dirty_tiles.a.y, r.a.y)),
+                          Point(std::max(dirty_tiles.b.x, r.b.x), std::max(dirty_tiles.b.y, r.b.y)));
+    }
+
+    bool take_dirty(Box& r) {
+        r = dirty_tiles;
+        bool ret = has_dirty;
+        has_dirty = false;
+        return ret;
+    }
+
+    // Must precede every write to the ground layer while a background save holds a snapshot.
+    void prepare_write(Box r) {
+        if (!snapshot.active || r.a.x >= r.b.x || r.a.y >= r.b.y) {
+            return;
+        }
+        Size grid = chunk_grid();
+        for (I32 cy = r.a.y / CHUNK_SIZE; cy <= (r.b.y - 1) / CHUNK_SIZE; cy++) {
+            for (I32 cx = r.a.x / CHUNK_SIZE; cx <= (r.b.x - 1) / CHUNK_SIZE; cx++) {
+                I32 chunk = cy * grid.w + cx;
+                snapshot.before_write(LAYER_GROUND * grid.w * grid.h + chunk, tiles_ground, map_size.w, chunk_box(chunk));
+            }
+        }
+    }
+
+    void set_tile(I16 x, I16 y, const String& texture_name, bool ground) {
+        Texture* t = get(texture_name);
+        if (ground && t) {
+            prepare_write(Box(Point(x, y), Point(x + 1, y + 1)));
+            tiles_ground[y * map_size.w + x] = t->id;
+            mark_dirty(Box(Point(x, y), Point(x + 1, y + 1)));
+        }
+    }
+
+    // The map is split into CHUNK_SIZE squares for saving, chunks on the right and bottom edges may be smaller.
+    static inline constexpr I16 CHUNK_SIZE = 64;
+
+    Size chunk_grid() { return Size((map_size.w + CHUNK_SIZE - 1) / CHUNK_SIZE, (map_size.h + CHUNK_SIZE - 1) / CHUNK_SIZE); }
+
+    Box chunk_box(I32 chunk) {
+        Size grid = chunk_grid();
+        return clip_to_map({(I16)(chunk % grid.w * CHUNK_SIZE), (I16)(chunk / grid.w * CHUNK_SIZE)}, {CHUNK_SIZE, CHUNK_SIZE});
+    }
+
+    // Empty, b.x <= a.x or b.y <= a.y, when the block lies entirely outside the map.
+    Box clip_to_map(Point pos, Size s) {
+        return Box(Point(std::max<short>(pos.x, 0), std::max<short>(pos.y, 0)),
+                   Point(std::min<int>(pos.x + s.w, map_size.w), std::min<int>(pos.y + s.h, map_size.h)));
+    }
+
+    // Copies a row-major block of ids (width s.w) into the ground layer, parts outside the map are skipped.
+    void set_tiles(const TextureID* ids, Point pos, Size s) {
+        Box r = clip_to_map(pos, s);
+        if (r.a.x >= r.b.x || r.a.y >= r.b.y) {
+            return;
+        }
+        prepare_write(r);
+        for (I16 y = r.a.y; y < r.b.y; y++) {
+            const TextureID* src = ids + (y - pos.y) * s.w + (r.a.x - pos.x);
+            std::copy(src, src + (r.b.x - r.a.x), tiles_ground + y * map_size.w + r.a.x);
+        }
+        mark_dirty(r);
+    }
+
+    void fill_tiles(Point pos, Size s, TextureID id) {
+        Box r = clip_to_map(pos, s);
+        if (r.a.x >= r.b.x || r.a.y >= r.b.y) {
+            return;
+        }
+        prepare_write(r);
+        for (I16 y = r.a.y; y < r.b.y; y++) {
+            std::fill(tiles_ground + y * map_size.w + r.a.x, tiles_ground + y * map_size.w + r.b.x, id);
+        }
+        mark_dirty(r);
+    }
+
+    // Headless renders into an engine-owned framebuffer without a window.
+    UI(Size s, bool headless = false) {
+        size = s;
+        if (headless) {
+            pixels = new Color[s.w * s.h];
+            std::fill(pixels, pixels + s.w * s.h, Color(0, 0, 0, 0));
+            return;
+        }
+        if (!window) {
+            #ifdef _WIN32
+            SDL_setenv("SDL_AUDIODRIVER", "directsound", true); 
+            #endif
+            SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
+            window = SDL_CreateWindow("", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, s.w, s.h, 0);
+            //if (fullscreen) {
+            //    SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
+            //}
+        }
+        pixels = (Color*)SDL_GetWindowSurface(window)->pixels;
+    }
+
+    void draw(Widget* w) {
+        if (w->texture) {
+            blit(w->texture->pixels, w->texture->size, w->texture->stride, w->pos, Box(w->pos, w->size), w->texture->transparent);
+        }
+        if (w == tilemap_widget) {
+            ProfileScope scope(STAGE_TILEMAP);
+            draw_tilemap();
+        }
+        if (w->letters.empty()) {
+            return;
+        }
+        ProfileScope scope(STAGE_TEXT);
+        Point p = w->pos + w->letters_offset;
+        for (auto& line : w->letters) {
+            I16 line_height = 0;
+            for (Texture* letter : line) {
+                blit(letter->pixels, letter->size, letter->stride, p, Box(w->pos, w->size), true);
+                p.x += letter->size.w;
+                line_height = letter->size.h > line_height ? letter->size.h : line_height;
+            }
+            p.x = w->pos.x;
+            p.y += line_height;
+        }
+    }
+
+    void update() {
+        {
+            ProfileScope scope(STAGE_WIDGETS);
+            std::vector<Widget*> widgets(top_widgets);
+            I32 idx = 0;
+            while (idx < widgets.size()) {
+                Widget* w = widgets[idx];
+                if (w->remove) {
+                    if (w->parent) {
+                        vector_remove(w->parent->children, w);
+                    } else {
+                        vector_remove(top_widgets, w);
+                    }
+                    delete w;
+                    ++idx;
+                    continue;
+                }
+                draw(w);
+                for (Widget* child : w->children) {
+                    widgets.push_back(child);
+                }
+                ++idx;
+            }
+            if (profiler_overlay) {
+                draw(profiler_overlay);
+            }
+        }
+        {
+            ProfileScope scope(STAGE_PRESENT);
+            if (window) {
+                SDL_UpdateWindowSurface(window);
+            }
+        }
+        long long t_now = now();
+        long long t = t_now - last_update;
+        fps = t > 0 ? 1000000 / t : 0;
+        last_update = t_now;
+        g_profiler.end_frame(t);
+        if (profiler_overlay && g_profiler.frames % 30 == 0) {
+            update_profiler_overlay();
+        }
+    }
+
+    void show_profiler(bool show) {
+        if (show && !profiler_overlay) {
+            Size s(320, 14 * (STAGE_COUNT + 3));
+            Color* background = new Color[s.w * s.h];
+            std::fill(background, background + s.w * s.h, Color(0, 0, 0, 160));
+            profiler_overlay = new Widget(s);
+            profiler_overlay->texture = new Texture(background, s, true);
+            update_profiler_overlay();
+        } else if (!show && profiler_overlay) {
+            delete[] profiler_overlay->texture->pixels;
+            delete profiler_overlay->texture;
+            delete profiler_overlay;
+            profiler_overlay = nullptr;
+        }
+    }
+
+    void update_profiler_overlay() {
+        char line[128];
+        snprintf(line, sizeof(line), "%d fps      last   min   avg   p99\n", fps);
+        String text = line;
+        for (I32 i = 0; i < STAGE_COUNT; i++) {
+            ProfileStats st = g_profiler.stats(i);
+            snprintf(line, sizeof(line), "%-8s %6.2f %5.2f %5.2f %5.2f\n", Profiler::stage_names[i], st.last, st.min, st.avg, st.p99);
+            text += line;
+        }
+        I32 chunks = g_profiler.autosave_chunks;
+        snprintf(line, sizeof(line), "autosave %3d%%  last %.1f ms\n", chunks ? 100 * g_profiler.autosave_chunks_written / chunks : 0,
+                 g_profiler.autosave_us / 1000.0f);
+        text += line;
+        set_text(profiler_overlay, text, 12, {4, 2});
+    }
+
+    bool save_frame(const String& path) {
+        SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormatFrom(pixels, size.w, size.h, 32, size.w * sizeof(Color), SDL_PIXELFORMAT_ARGB8888);
+        if (!surface) {
+            return false;
+        }
+        bool ok = SDL_SaveBMP(surface, path.c_str()) == 0;
+        SDL_FreeSurface(surface);
+        return ok;
+    }
+
+    void load_letters(int height, Color color) {
+        String fontpath = "./mono.ttf";
+        letter_to_texture[height].resize(LETTER_MAX + 1);
+        Vector<U8> storage;
+        size_t size;
+        const unsigned char* ttf_buffer = g_assets.read(fontpath, storage, size);
+        if (!ttf_buffer) {
+            return;
+        }
+        stbtt_fontinfo font;
+        stbtt_InitFont(&font, ttf_buffer, stbtt_GetFontOffsetForIndex(ttf_buffer,0));
+        float scale = stbtt_ScaleForPixelHeight(&font, (float)height);
+        int ascent, descent, lineGap;
+        stbtt_GetFontVMetrics(&font, &ascent, &descent, &lineGap);  
+        ascent = roundf(ascent * scale);
+        descent = roundf(descent * scale);
+        for (char c = LETTER_MIN; c < LETTER_MAX; c++) {
+            int leftSideBearing;
+            int advanceWidth;
+            stbtt_GetCodepointHMetrics(&font, c, &advanceWidth, &leftSideBearing);
+            advanceWidth *= c == ' ' ? scale : 0;
+            leftSideBearing *= scale;
+            int c_x1, c_y1, c_x2, c_y2;
+            stbtt_GetCodepointBitmapBox(&font, c, scale, scale, &c_x1, &c_y1, &c_x2, &c_y2);
+            int y_char = ascent + c_y1;
+            int w = c_x2 - c_x1;
+            int h = c_y2 - c_y1;
+            unsigned char* bitmap = new unsigned char[w * h];
+            stbtt_MakeCodepointBitmap(&font, bitmap, w, h, w, scale, scale, c);
+            Size s(w + leftSideBearing + advanceWidth, y_char + h);
+            Color* out = new Color[s.w * s.h];
+            for (int y = y_char; y < s.h; y++) {
+                for (int x = leftSideBearing; x < w + leftSideBearing; x++) {
+                    out[y * s.w + x] = color;
+                    out[y * s.w + x].alpha = bitmap[(y - y_char) * w + (x - leftSideBearing)];
+                }
+            }
+            delete[] bitmap;
+            letter_to_texture[height][c] = new Texture(out, s, true);
+        }
+    }
+
+    // Ids are TextureIDs, so at most INT16_MAX textures can be registered. On failure the caller keeps t.
+    bool register_texture(const String& name, Texture* t, bool scale) {
+        if (name_to_texture.find(name) != name_to_texture.end() || id_to_texture.size() > INT16_MAX) {
+            return false;
+        }
+        t->id = id_to_texture.size();
+        id_to_texture.push_back(t);
+        name_to_texture[name] = t;
+        return true;
+    }
+
+    Texture* get(const std::string& name) {
+        if (name_to_texture.find(name) != name_to_texture.end()) {
+            return name_to_texture[name]; 
+        }
+        return nullptr;
+    }
+
+    Texture* get(char letter, int size) {
+        if (letter_to_texture[size].empty()) {
+            load_letters(size, Color(255, 255, 255, 255));
+        }
+        return letter_to_texture[size][letter]; 
+    }
+
+    // texture_size is the size on screen, stride the number of pixels per row of the unzoomed texture.
+    void blit(Color* texture, Size texture_size, I32 stride, Point start, Box canvas, bool transparent=false, float zoom=1.0f) {
+        Point texture_end(start.x + texture_size.w, start.y + texture_size.h);
+        Point texture_start(0, 0);
+        Point texture_endcut(0, 0);
+        if (start.x < canvas.a.x) {
+            texture_start.x = (canvas.a.x - start.x);
+            start.x = canvas.a.x;
+        } else if (texture_end.x > canvas.b.x) {
+            texture_endcut.x = texture_end.x - canvas.b.x;
+        }
+        if (start.y < canvas.a.y) {
+            texture_start.y = (canvas.a.y - start.y);
+            start.y = canvas.a.y;
+        } else if (texture_end.y > canvas.b.y) {
+            texture_endcut.y = texture_end.y - canvas.b.y;
+        }
+        
+        unsigned* texture_pixels = (unsigned*)(texture + (unsigned)(texture_start.x / zoom)); 
+        unsigned* screen_pixels = (unsigned*)(pixels + start.y * size.w + start.x);
+        I16 upper_bound_x = texture_size.w - texture_start.x - texture_endcut.x;
+        I16 upper_bound_y = texture_size.h - texture_start.y - texture_endcut.y;
+        if (upper_bound_y <= 0 || upper_bound_x <= 0) {
+            return;
+        }
+        
+        if (transparent) {
+            for (I16 y = 0; y < upper_bound_y; y++) {
+                for (I16 x = 0; x < upper_bound_x; x++) {
+                    unsigned color1 = screen_pixels[y * size.w + x];
+                    unsigned color2 = texture_pixels[int((y + texture_start.y) / zoom) * stride + int(x / zoom)];
+                    unsigned rb = (color1 & 0xff00ff) + (((color2 & 0xff00ff) - (color1 & 0xff00ff)) * ((color2 & 0xff000000) >> 24) >> 8);
+                    unsigned g  = (color1 & 0x00ff00) + (((color2 & 0x00ff00) - (color1 & 0x00ff00)) * ((color2 & 0xff000000) >> 24) >> 8);
+                    screen_pixels[y * size.w + x] = (rb & 0xff00ff) | (g & 0x00ff00);
+                }
+            }
+        } else {
+           for (I16 y = 0; y < upper_bound_y; y++) {
+                for (I16 x = 0; x < upper_bound_x; x++) {
+                    screen_pixels[y * size.w + x] = texture_pixels[int((y + texture_start.y) / zoom) * stride + int(x / zoom)];
+                }
+           }
+        }
+        
+    }
+
+    void add_widget(Widget* parent, Widget* child, Point offset) {
+        if (!parent) {
+            child->pos = offset;
+            top_widgets.push_back(child);
+            update_listeners(child);
+            return;
+        }
+        parent->children.push_back(child);
+        child->parent = parent;
+        std::function<void(Widget*, Point)> offset_position = [&](Widget* w, Point offset) {
+            w->pos = w->pos + offset;
+            update_listeners(w);
+            for (auto& child : w->children) {
+                offset_position(child, offset);
+            }
+            return;
+        };
+        offset_position(child, parent->pos + offset);
+    }
+
+    void update_listeners(Widget* w) {
+        if (w->listener) {
+            g_input->move_mouse_listener(w->listener, Box(w->pos, w->size), w->depth());
+        }
+        if (w->hover_listener) {
+            g_input->move_mouse_listener(w->hover_listener, Box(w->pos, w->size), w->depth());
+        }
+    }
+
+    void set_texture(Widget* w, const String& name) {
+        w->texture = name_to_texture[name];
+    }
+
+    void set_text(Widget* w, const String& txt, I16 txt_height, Point offset) {
+        w->letters_offset = offset;
+        Vector<Vector<Texture*>>& lines = w->letters;
+        lines.clear();
+        lines.resize(1);
+        std::vector<Texture*> word;
+        int current_line = 0;
+        short word_length = 0;
+        short line_length = 0;
+        short line_height = 0;
+        short total_height = 0;
+
+        for (int i = 0; i < (int)txt.size(); i++) {
+            bool newline = i < (int)txt.size()-1 ? txt[i] == 10 : false;
+            if (newline) {
+                total_height += line_height;
+                lines[current_line].insert(lines[current_line].end(), word.begin(), word.end());
+                lines.push_back(std::vector<Texture*>());
+                line_length = 0;
+                line_height = 0;
+                current_line++;
+                word.clear();
+                word_length = 0;
+                continue;
+            }
+            Texture* t = get(txt[i], txt_height);
+            if (t) {
+                word.push_back(t);
+                word_length += t->size.w;
+                line_height = t->size.h > line_height ? t->size.h : line_height;
+            }
+            if (txt[i] == ' ' || i == (int)(txt.size()-1)) {
+                if (line_length + word_length < w->size.w) {
+                    lines[current_line].insert(lines[current_line].end(), word.begin(), word.end());
+                    line_length += word_length;
+                } else {
+                    total_height += line_height;
+                    if (total_height + line_height > w->size.h) { 
+                        //std::cout << "Text too long!" << std::endl;
+                        // add excess text handling here
+                        break;
+                    }
+                    lines.push_back(word);
+                    line_length = word_length;
+                    line_height = 0;
+                    current_line++;
+                }
+                word.clear();
+                word_length = 0;
+            }
+        }
+    }
+
+    struct Anchor {
+        static constexpr int PERC_FACTOR = 100000;
+        Anchor(Point p, double pc, char t): pos(p), perc(PERC_FACTOR * pc), temp(t) {}
+        Point pos;
+        long long perc;
+        char temp;
+    };
+
+    void randomize_map() { randomize_map(std::uniform_int_distribution<U32>()(random_generator)); }
+
+    // The map only depends on the seed and the MapConfig, so saves can regenerate it instead of storing it.
+    void randomize_map(U32 seed) {
+        ProfileScope scope(STAGE_MAPGEN);
+        prepare_write(Box(Point(0, 0), map_size));
+        random_seed(seed);
+        MapConfig& config = *map_config;
+        Size num_cells = {config.num_cells, config.num_cells};
+        Size cell_size = map_size / num_cells;
+        int max_samples = cell_size.w * cell_size.h * config.sample_factor; // 3
+        int sample_dist = config.sample_distance; // 2
+        
+        char* heightmap = new char[map_size.w * map_size.h];
+        std::memset(heightmap, 0, map_size.w * map_size.h);
+        MapConfig::Biome& mountain_biome = config.elevations.back().biomes[0];
+        unsigned char max_height = mountain_biome.max_height - 1;
+        F32 height_cutoff = 1 - config.elevations.back().perc;
+        short wall_height = mountain_biome.wall_height;
+
+        const int climate_cluster_factor = 4;
+        double r;
+        Vector<Anchor> anchors;
+        for (short y = 0; y < num_cells.h; y++) {
+            for (short x = 0; x < num_cells.w; x++) {
+                if (x % climate_cluster_factor == 0 && y % climate_cluster_factor == 0) {
+                    r = random_uniform(20, 80);
+                } else {
+                    short use_x = x - (x % climate_cluster_factor);
+                    short use_y = (y - (y % climate_cluster_factor)) * num_cells.w; 
+                    r = anchors[use_y + use_x].temp;
+                }
+                anchors.emplace_back(
+                    Point((x + random_fast()) * cell_size.w, (y + random_fast()) * cell_size.h), 
+                    random_fast(),
+                    r
+                ); 
+            }
+        }
+        /*
+        for (short y_map = 0; y_map < map_size.h; y_map++) {
+            for (short x_map = 0; x_map < map_size.w; x_map++) {
+                tiles_ground->get(x_map, y_map) = 0;
+                tiles_above->get(x_map, y_map) = 0;
+                heightmap->get(x_map, y_map) = 0;
+            }
+        }
+        */
+        //parallel_for(0, num_cells.h-1, [&](int y_cell) {
+        for (I16 y_cell = 0; y_cell < num_cells.h; y_cell++) {        
+            for (I16 x_cell = 0; x_cell < num_cells.w; x_cell++) {
+                Box sample_cells(Point(x_cell - sample_dist, y_cell - sample_dist), Point(x_cell + sample_dist, y_cell + sample_dist));
+                Vector<Anchor> current_anchors;
+                for (short y_cells = sample_cells.a.y; y_cells <= sample_cells.b.y; y_cells++) {
+                    for (short x_cells = sample_cells.a.x; x_cells <= sample_cells.b.x; x_cells++) {
+                        short x_cur = x_cells;
+                        short x_offset = 0;
+                        if (x_cur < 0) {
+                            x_offset = -map_size.w;
+                            x_cur += num_cells.w;
+                        } else if (x_cur > num_cells.w - 1) {
+                            x_offset = map_size.w;
+                            x_cur -= num_cells.w;
+                        }
+                        short y_cur = y_cells;
+                        short y_offset = 0;
+                        if (y_cur < 0) {
+                            y_offset = -map_size.h;
+                            y_cur += num_cells.h;
+                        } else if (y_cur > num_cells.h - 1) {
+                            y_offset = map_size.h;
+                            y_cur -= num_cells.h;
+                        }
+                        current_anchors.emplace_back(anchors[y_cur * num_cells.w + x_cur]);
+                        current_anchors.back().pos.x += x_offset;
+                        current_anchors.back().pos.y += y_offset;
+                    }
+                }
+                for (I16 y_map = y_cell * cell_size.h; y_map < (I16)((y_cell + 1) * cell_size.h); y_map++) {
+                    for (I16 x_map = x_cell * cell_size.w; x_map < (I16)((x_cell + 1) * cell_size.w); x_map++) {
+                        unsigned long long sum_val = 0;
+                        unsigned long long sum_temp = 0;
+                        unsigned long long total_samples = 0;
+                        for (int i = 0; i < (int)current_anchors.size(); i++) {
+                            int diffx = current_anchors[i].pos.x - x_map;
+                            int diffy = current_anchors[i].pos.y - y_map;
+                            int dist = ((diffx ^ (diffx >> 31)) - (diffx >> 31)) + ((diffy ^ (diffy >> 31)) - (diffy >> 31));
+                            int num_samples = max_samples - dist * dist;
+                            num_samples = 1 + (num_samples & -((num_samples >> 31) ^ 1));
+                            sum_val += num_samples * current_anchors[i].perc;
+                            sum_temp += num_samples * current_anchors[i].temp;
+                            total_samples += num_samples;
+                        }
+                        double total_val = (double)sum_val / (total_samples * Anchor::PERC_FACTOR);
+                        double total_temp = (double)sum_temp / total_samples;
+
+                        double current_val = 0;
+                        for (MapConfig::Elevation& elevation : config.elevations) {
+                            current_val += elevation.perc;
+                            if (total_val - current_val <= 0.001) {
+                                int biome_index = 0;
+                                if (elevation.biomes.size() > 1) {
+                                    for (biome_index = 0; biome_index < (int)elevation.biomes.size()-1; biome_index++) {
+                                        if (total_temp < elevation.temperatures[biome_index]) {
+                                            break;
+                                        }
+                                    }
+                                }
+                                MapConfig::Biome& biome = elevation.biomes[biome_index];
+                                if (biome.max_height > 0) {
+                                    char height = max_height * (total_val - height_cutoff) / (1 - height_cutoff);
+                                    heightmap[y_map * map_size.w + x_map] = height < 0 ? 0 : height;
+                                }
+                                if (biome.id < 0) {
+                                    Texture* t = get(biome.name);
+                                    biome.id = t->id;
+                                }
+                                tiles_ground[y_map * map_size.w + x_map] = biome.id;
+                                //map->set_ground(biome.id(), {x_map, y_map}, biome.blocking);
+                                double val = random_fast();
+                                current_val = 0;
+                                for (auto& item : biome.items) {
+                                    current_val += item.perc;
+                                    if (val - current_val <= 0.01) {
+                                        if (item.id < 0) {
+                                            Texture* t = get(item.name);
+                                            item.id = t->id;
+                                            item.size = t->size;
+                                        }
+                                        //map->set_tile(item.id(), {x_map, y_map}, item.size() / tile_dim);
+                                        break;
+                                    }
+                                }
+                                break;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+        TextureID mountain_id = get(mountain_biome.name_wall)->id;
+        for (I16 y_map = 1; y_map < map_size.h - wall_height; y_map++) {
+            for (I16 x_map = 1; x_map < map_size.w - 1; x_map++) {
+                if (heightmap[y_map * map_size.w + x_map] > heightmap[(y_map+1) * map_size.w + x_map]) {
+                    for (int i = 1; i <= wall_height; i++) { 
+                        tiles_ground[(y_map + i) * map_size.w + x_map] = mountain_id;
+                    }
+                }
+            }
+        }
+        delete[] heightmap;
+        mark_dirty(Box(Point(0, 0), map_size));
+        reset_chunks();
+        map_seed = seed;
+        map_from_seed = true;
+    }
 };
 
-struct Texture {
-    Texture(Color* p, Size s, bool t=false): pixels(p), size(s), transparent(t) {}
-    Color* pixels = nullptr;
-    Size size;
-    I16 id;
-    bool transparent = false;
+static UI* g_ui = nullptr;
+
+
+
+//
+// World files: seed, MapConfig, texture names and all tile layers, each chunk deflated on its own
+//
+
+struct ByteWriter {
+    template <typename T>
+    void put(T v) { data.insert(data.end(), (const U8*)&v, (const U8*)&v + sizeof(T)); }
+    void put_string(const String& s) {
+        put<U16>(s.size());
+        data.insert(data.end(), s.begin(), s.end());
+    }
+    Vector<U8> data;
 };
 
-struct Widget {
-    Widget(Size s): size(s) {}
-    ~Widget() {
-        if (listener) {
-            g_input->remove_mouse_listener(listener);
+// Reads past the end return zeros and clear ok.
+struct ByteReader {
+    ByteReader(const U8* d, size_t size): p(d), end(d + size) {}
+    template <typename T>
+    T get() {
+        T v = T();
+        if (ok && end - p >= (ptrdiff_t)sizeof(T)) {
+            std::memcpy(&v, p, sizeof(T));
+            p += sizeof(T);
+        } else {
+            ok = false;
         }
-        for (Widget* c : children) delete c;
+        return v;
     }
-    Size size;
-    Point pos;
-    Texture* texture = nullptr;
-    Widget* parent = nullptr;
-    Vector<Widget*> children;
-    Vector<Vector<Texture*>> letters;
-    Point letters_offset;
-    bool remove = false;
-    Input::Listener* listener = nullptr;
+    String get_string() {
+        U16 n = get<U16>();
+        if (!ok || end - p < n) {
+            ok = false;
+            return "";
+        }
+        p += n;
+        return String((const char*)p - n, n);
+    }
+    const U8* p;
+    const U8* end;
+    bool ok = true;
 };
-    
-struct Camera {
-    Camera(int a, int b): x(a), y(b) {}
-    Camera(double a, double b): x(a), y(b) {}
-    int x;
-    int y;
-    Camera operator+(const Point& p) { return Camera(x + p.x, y + p.y); }
-    Camera operator-(const Point& p) { return Camera(x - p.x, y - p.y); }
-    Camera operator+(const Camera& p) { return Camera(x - p.x, y - p.y); }
-    Camera operator-(const Camera& p) { return Camera(x - p.x, y - p.y); }
+
+// State of the delta save journal World::save_delta() appends to.
+struct WorldJournal {
+    String path;
+    U32 revision = 0;
+    I32 records = 0;
+    size_t bytes = 0;
+    size_t header_bytes = 0;
+    Vector<U32> chunk_bytes;
 };
 
-template<class T, size_t N>
-constexpr size_t size(T (&)[N]) { return N; }
+struct World {
+    static inline constexpr char MAGIC[4] = {'E', 'W', 'L', 'D'};
+    static inline constexpr U32 VERSION = 1;
 
-struct UI {    
-    Widget* tilemap_widget = nullptr; 
-    TextureID* tiles_ground = nullptr;
-    Size tile_dim = {0, 0};
-    Size map_size = {0, 0};
-    Camera camera_pos = {0, 0};
-    Point move_vector = {0, 0};
-    bool infinite_scrolling = true;
-    static inline constexpr char LETTER_MIN = 32;
-    static inline constexpr char LETTER_MAX = 127;
-    SDL_Window* window = nullptr;
-    Color* pixels;
-    Size size;
-    long long last_update = now();
-    I32 fps = 0;
-    Texture* id_to_texture[15000] = {0};
-    Map<String, Texture*> name_to_texture;
-    Vector<Texture*> letter_to_texture[1024];
-    TextureID currentID = 1;
-    int zoom_idx = 3;
-    float zoom = 1.0;
-    constexpr static inline float zoom_levels[6] = {0.125, 0.25, 0.5, 1.0, 2.0, 4.0};
-    Vector<Widget*> top_widgets;
-    MapConfig* map_config = new MapConfig();
+    static bool read_file(const String& path, Vector<U8>& data) {
+        FILE* f = fopen(path.c_str(), "rb");
+        if (!f) {
+            return false;
+        }
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+        data.resize(size > 0 ? size : 0);
+        bool ok = size > 0 && fread(data.data(), size, 1, f) == 1;
+        fclose(f);
+        return ok;
+    }
 
-    Box visible_tiles() {
-        constexpr short pad = 1;
-        I16 xstart = (camera_pos.x) / (zoom * tile_dim.w) - pad;
-        I16 xend = (camera_pos.x + size.w) / (zoom * tile_dim.w) + pad;
-        I16 ystart = (camera_pos.y) / (zoom * tile_dim.h) - pad;
-        I16 yend = (camera_pos.y + size.h) / (zoom * tile_dim.h) + pad;
-        return {Point(xstart, ystart), Point(xend, yend)};
+    // Written next to the target and renamed over it, so an interrupted save never replaces a good one.
+    static bool write_file(const String& path, const Vector<U8>& data) {
+        String tmp = path + ".tmp";
+        FILE* f = fopen(tmp.c_str(), "wb");
+        if (!f) {
+            return false;
+        }
+        bool ok = fwrite(data.data(), data.size(), 1, f) == 1;
+        ok = fclose(f) == 0 && ok;
+        std::error_code error;
+        if (ok) {
+            std::filesystem::rename(tmp, path, error);
+        }
+        if (!ok || error) {
+            std::filesystem::remove(tmp, error);
+            return false;
+        }
+        return true;
     }
 
-    void draw_tilemap() {
-        if (move_vector.x == move_vector.y) {
-            move_vector.x = sqrt(move_vector.x * move_vector.x + move_vector.y * move_vector.y);
-            move_vector.x = move_vector.y;
+    static void write_config(ByteWriter& w, const MapConfig& config) {
+        w.put<I16>(config.num_cells);
+        w.put<I16>(config.sample_distance);
+        w.put<I16>(config.sample_factor);
+        w.put<U32>(config.elevations.size());
+        for (auto& elevation : config.elevations) {
+            w.put<F64>(elevation.perc);
+            w.put<U32>(elevation.biomes.size());
+            for (size_t i = 0; i < elevation.biomes.size(); i++) {
+                const MapConfig::Biome& biome = elevation.biomes[i];
+                w.put_string(biome.name);
+                w.put_string(biome.name_wall);
+                w.put<I16>(biome.max_height);
+                w.put<I16>(biome.wall_height);
+                w.put<U8>(biome.blocking);
+                w.put<I8>(elevation.temperatures[i]);
+                w.put<U32>(biome.items.size());
+                for (auto& item : biome.items) {
+                    w.put_string(item.name);
+                    w.put<F64>(item.perc);
+                }
+            }
         }
-        camera_pos = camera_pos + move_vector;
-        fix_camera();
-        move_vector = {0, 0};
-        Box canvas(tilemap_widget->pos, tilemap_widget->size);
-        const Box visible = visible_tiles();
-        const Size tile_size(tile_dim.w * zoom, tile_dim.h * zoom);
-        for (I16 y = visible.a.y; y <= visible.b.y; y++) {
-            for (I16 x = visible.a.x; x <= visible.b.x; x++) {
-                Point p(x, y, map_size);
-                Point start(tilemap_widget->pos.x - camera_pos.x + x * tile_size.w, tilemap_widget->pos.y - camera_pos.y + y * tile_size.h);
-                TextureID ground_id = tiles_ground[p.y * map_size.w + p.x];
-                Texture* texture_ground = id_to_texture[ground_id < 0 ? -ground_id : ground_id];
-                if (texture_ground) {
-                    blit(texture_ground->pixels, tile_size, start, canvas, false, zoom);
+    }
+
+    static MapConfig* read_config(ByteReader& r) {
+        MapConfig* config = new MapConfig();
+        config->num_cells = r.get<I16>();
+        config->sample_distance = r.get<I16>();
+        config->sample_factor = r.get<I16>();
+        U32 num_elevations = r.get<U32>();
+        for (U32 e = 0; r.ok && e < num_elevations; e++) {
+            MapConfig::Elevation& elevation = config->elevations.emplace_back(r.get<F64>());
+            U32 num_biomes = r.get<U32>();
+            for (U32 b = 0; r.ok && b < num_biomes; b++) {
+                String name = r.get_string();
+                String name_wall = r.get_string();
+                I16 max_height = r.get<I16>();
+                I16 wall_height = r.get<I16>();
+                bool blocking = r.get<U8>();
+                MapConfig::Biome& biome = elevation.biomes.emplace_back(name, name_wall, max_height, wall_height, blocking);
+                elevation.temperatures.push_back(r.get<I8>());
+                U32 num_items = r.get<U32>();
+                for (U32 i = 0; r.ok && i < num_items; i++) {
+                    String item = r.get_string();
+                    biome.items.emplace_back(item, r.get<F64>());
+                }
+            }
+        }
+        return config;
+    }
+
+    // Layout: magic, version, seed, map and tile size, MapConfig, (id, name) of every texture,
+    // layer count, chunk size, compressed size of every chunk (layer major, row major), chunk data.
+    static void write_header(UI& ui, ByteWriter& w, const char* magic, U32 seed) {
+        w.data.insert(w.data.end(), magic, magic + sizeof(MAGIC));
+        w.put<U32>(VERSION);
+        w.put<U32>(seed);
+        w.put<I16>(ui.map_size.w);
+        w.put<I16>(ui.map_size.h);
+        w.put<I16>(ui.tile_dim.w);
+        w.put<I16>(ui.tile_dim.h);
+        write_config(w, *ui.map_config);
+        w.put<U32>(ui.name_to_texture.size());
+        for (auto& [name, texture] : ui.name_to_texture) {
+            w.put<TextureID>(texture->id);
+            w.put_string(name);
+        }
+        w.put<U32>(LAYER_COUNT);
+        w.put<U32>(UI::CHUNK_SIZE);
+    }
+
+    static void compress_chunk(const TextureID* rows, I32 stride, Box b, Vector<U8>& out) {
+        static thread_local std::unique_ptr<sdefl> deflate(new sdefl());
+        TextureID raw[UI::CHUNK_SIZE * UI::CHUNK_SIZE];
+        I16 width = b.b.x - b.a.x;
+        for (I16 y = 0; y < b.b.y - b.a.y; y++) {
+            std::copy(rows + y * stride, rows + y * stride + width, raw + y * width);
+        }
+        int bytes = width * (b.b.y - b.a.y) * sizeof(TextureID);
+        out.resize(sdefl_bound(bytes));
+        out.resize(sdeflate(deflate.get(), out.data(), raw, bytes, SDEFL_LVL_DEF));
+    }
+
+    static bool write_world(const String& path, ByteWriter& w, const Vector<Vector<U8>>& blobs) {
+        for (auto& blob : blobs) {
+            w.put<U32>(blob.size());
+        }
+        for (auto& blob : blobs) {
+            w.data.insert(w.data.end(), blob.begin(), blob.end());
+        }
+        return write_file(path, w.data);
+    }
+
+    static bool save(UI& ui, const String& path) {
+        if (!ui.tilemap_widget) {
+            return false;
+        }
+        finish_autosave(ui, true);
+        ByteWriter w;
+        write_header(ui, w, MAGIC, random_seed_value);
+        forget_journal(path);
+        Size grid = ui.chunk_grid();
+        I32 chunks = grid.w * grid.h;
+        Vector<Vector<U8>> blobs(LAYER_COUNT * chunks);
+        parallel_for(0, blobs.size(), [&](int i) {
+            Box b = ui.chunk_box(i % chunks);
+            compress_chunk(ui.layer(i / chunks) + b.a.y * ui.map_size.w + b.a.x, ui.map_size.w, b, blobs[i]);
+        });
+        return write_world(path, w, blobs);
+    }
+
+    // The header is taken right away, the chunks are compressed and written by a background thread from
+    // a copy-on-write snapshot, so gameplay continues while the save is written.
+    static bool autosave(UI& ui, const String& path) {
+        finish_autosave(ui, false);
+        if (autosave_thread || !ui.tilemap_widget) {
+            return false;
+        }
+        std::shared_ptr<ByteWriter> header(new ByteWriter());
+        write_header(ui, *header, MAGIC, random_seed_value);
+        forget_journal(path);
+        Size grid = ui.chunk_grid();
+        I32 chunks = grid.w * grid.h;
+        ui.snapshot.begin(LAYER_COUNT * chunks);
+        g_profiler.autosave_chunks = LAYER_COUNT * chunks;
+        g_profiler.autosave_chunks_written = 0;
+        g_profiler.autosave_running = true;
+        autosave_thread = new std::thread([&ui, path, header, chunks]() {
+            Tracer::thread_name = "autosave";
+            TRACE_ZONE("autosave");
+            long long start = now();
+            Vector<Vector<U8>> blobs(LAYER_COUNT * chunks);
+            for (I32 i = 0; i < (I32)blobs.size(); i++) {
+                Box b = ui.chunk_box(i % chunks);
+                I32 stride;
+                const TextureID* rows = ui.snapshot.acquire(i, ui.layer(i / chunks), ui.map_size.w, b, stride);
+                compress_chunk(rows, stride, b, blobs[i]);
+                ui.snapshot.release(i);
+                g_profiler.autosave_chunks_written++;
+            }
+            if (!write_world(path, *header, blobs)) {
+                print("autosave: could not write " + path);
+            }
+            g_profiler.autosave_us = now() - start;
+            g_profiler.autosave_running = false;
+        });
+        return true;
+    }
+
+    // Main thread: joins a finished autosave and drops its snapshot, with wait it blocks until the save is written.
+    static void finish_autosave(UI& ui, bool wait) {
+        if (!autosave_thread || (!wait && g_profiler.autosave_running)) {
+            return;
+        }
+        autosave_thread->join();
+        delete autosave_thread;
+        autosave_thread = nullptr;
+        ui.snapshot.end();
+    }
+
+    static void poll_autosave(UI& ui) {
+        finish_autosave(ui, false);
+        if (autosave_interval_us > 0 && now() >= autosave_next) {
+            autosave(ui, autosave_path);
+            autosave_next = now() + autosave_interval_us;
+        }
+    }
+
+    static inline std::thread* autosave_thread = nullptr;
+    static inline String autosave_path;
+    static inline long long autosave_interval_us = 0;
+    static inline long long autosave_next = 0;
+
+    struct Header {
+        U32 seed = 0;
+        Size map_size;
+        Size tile_dim;
+        std::unique_ptr<MapConfig> config;
+        Vector<TextureID> remap;
+    };
+
+    // Tile ids are mapped to the ids the same texture names have in this session.
+    static bool read_header(UI& ui, ByteReader& r, Header& h) {
+        U32 version = r.get<U32>();
+        h.seed = r.get<U32>();
+        I16 dims[4];
+        for (I16& d : dims) d = r.get<I16>();
+        h.map_size = Size(dims[0], dims[1]);
+        h.tile_dim = Size(dims[2], dims[3]);
+        h.config.reset(read_config(r));
+        U32 num_textures = r.get<U32>();
+        for (U32 i = 0; r.ok && i < num_textures; i++) {
+            TextureID id = r.get<TextureID>();
+            Texture* t = ui.get(r.get_string());
+            if (id > 0) {
+                h.remap.resize(std::max<size_t>(h.remap.size(), id + 1), 0);
+                h.remap[id] = t ? t->id : 0;
+            }
+        }
+        U32 layers = r.get<U32>();
+        U32 chunk_size = r.get<U32>();
+        return r.ok && version == VERSION && layers == LAYER_COUNT && chunk_size == UI::CHUNK_SIZE && h.map_size.w > 0 && h.map_size.h > 0;
+    }
+
+    static bool inflate_chunk(const U8* src, size_t size, Box b, const Vector<TextureID>& remap, TextureID* dst, I32 stride) {
+        // One spare element, sinfl stops one byte short of cap on a trailing literal.
+        TextureID raw[UI::CHUNK_SIZE * UI::CHUNK_SIZE + 1];
+        I16 width = b.b.x - b.a.x;
+        int bytes = width * (b.b.y - b.a.y) * sizeof(TextureID);
+        if (sinflate(raw, sizeof(raw), src, size) != bytes) {
+            return false;
+        }
+        for (I16 y = 0; y < b.b.y - b.a.y; y++) {
+            for (I16 x = 0; x < width; x++) {
+                TextureID v = raw[y * width + x];
+                TextureID id = v < 0 ? -v : v;
+                id = id < (I32)remap.size() ? remap[id] : 0;
+                dst[y * stride + x] = v < 0 ? -id : id;
+            }
+        }
+        return true;
+    }
+
+    static void apply_header(UI& ui, Header& h) {
+        if (ui.map_size.w != h.map_size.w || ui.map_size.h != h.map_size.h) {
+            delete[] ui.tiles_ground;
+            ui.tiles_ground = new TextureID[h.map_size.w * h.map_size.h]();
+            ui.map_size = h.map_size;
+        }
+        ui.tile_dim = h.tile_dim;
+        delete ui.map_config;
+        ui.map_config = h.config.release();
+        ui.reset_chunks();
+    }
+
+    // Full saves and journals share the header, the magic tells them apart.
+    static bool load(UI& ui, const String& path) {
+        finish_autosave(ui, true);
+        Vector<U8> data;
+        if (!ui.tilemap_widget || !read_file(path, data) || data.size() < sizeof(MAGIC)) {
+            return false;
+        }
+        if (!std::memcmp(data.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC))) {
+            return load_journal(ui, path, data);
+        }
+        Header h;
+        ByteReader r(data.data() + sizeof(MAGIC), data.size() - sizeof(MAGIC));
+        if (std::memcmp(data.data(), MAGIC, sizeof(MAGIC)) || !read_header(ui, r, h)) {
+            return false;
+        }
+
+        Size old_size = ui.map_size;
+        ui.map_size = h.map_size;
+        Size grid = ui.chunk_grid();
+        I32 chunks = grid.w * grid.h;
+        Vector<size_t> offsets(LAYER_COUNT * chunks + 1);
+        for (size_t i = 0; i < offsets.size() - 1; i++) {
+            offsets[i + 1] = offsets[i] + r.get<U32>();
+        }
+        const U8* blobs = r.p;
+        if (!r.ok || (size_t)(r.end - blobs) < offsets.back()) {
+            ui.map_size = old_size;
+            return false;
+        }
+
+        // Chunks are inflated in parallel into fresh layers that only replace the current ones when the
+        // whole file is valid.
+        Vector<TextureID*> fresh(LAYER_COUNT);
+        for (auto& layer : fresh) {
+            layer = new TextureID[h.map_size.w * h.map_size.h];
+        }
+        std::atomic<bool> ok = true;
+        parallel_for(0, offsets.size() - 1, [&](int i) {
+            Box b = ui.chunk_box(i % chunks);
+            TextureID* dst = fresh[i / chunks] + b.a.y * h.map_size.w + b.a.x;
+            if (!inflate_chunk(blobs + offsets[i], offsets[i + 1] - offsets[i], b, h.remap, dst, h.map_size.w)) {
+                ok = false;
+            }
+        });
+        ui.map_size = old_size;
+        if (!ok) {
+            for (auto layer : fresh) delete[] layer;
+            return false;
+        }
+
+        delete[] ui.tiles_ground;
+        ui.tiles_ground = fresh[LAYER_GROUND];
+        ui.map_size = h.map_size;
+        apply_header(ui, h);
+        random_seed(h.seed);
+        ui.fix_camera();
+        ui.mark_dirty(Box(Point(0, 0), h.map_size));
+        ui.reset_chunks();
+        ui.map_from_seed = false;
+        forget_journal(path);
+        return true;
+    }
+
+    //
+    // Delta saves: a journal starts with the header (the seed being the map seed) and a flag telling whether
+    // the base map is regenerated from it. Every save appends one record with the chunks changed since the
+    // previous one: record size, chunk count and (chunk index, compressed size, data) per chunk.
+    // Loading regenerates the base map and applies the newest version of every chunk.
+    //
+
+    static inline constexpr char JOURNAL_MAGIC[4] = {'E', 'J', 'N', 'L'};
+    static inline constexpr I32 COMPACT_RECORDS = 32;
+
+    static inline WorldJournal journal;
+
+    static void forget_journal(const String& path) {
+        if (journal.path == path) {
+            journal = WorldJournal();
+        }
+    }
+
+    // Returns the compressed size of every chunk, commit_record() adopts them once the record is on disk.
+    static Vector<U32> write_record(UI& ui, ByteWriter& w, const Vector<I32>& chunks) {
+        Size grid = ui.chunk_grid();
+        I32 count = grid.w * grid.h;
+        Vector<Vector<U8>> blobs(chunks.size());
+        parallel_for(0, chunks.size(), [&](int i) {
+            Box b = ui.chunk_box(chunks[i] % count);
+            compress_chunk(ui.layer(chunks[i] / count) + b.a.y * ui.map_size.w + b.a.x, ui.map_size.w, b, blobs[i]);
+        });
+        size_t record_bytes = sizeof(U32);
+        for (auto& blob : blobs) {
+            record_bytes += 2 * sizeof(U32) + blob.size();
+        }
+        w.put<U32>(record_bytes);
+        w.put<U32>(chunks.size());
+        for (size_t i = 0; i < chunks.size(); i++) {
+            w.put<U32>(chunks[i]);
+            w.put<U32>(blobs[i].size());
+            w.data.insert(w.data.end(), blobs[i].begin(), blobs[i].end());
+        }
+        Vector<U32> sizes(chunks.size());
+        for (size_t i = 0; i < chunks.size(); i++) {
+            sizes[i] = blobs[i].size();
+        }
+        return sizes;
+    }
+
+    static void commit_record(UI& ui, const Vector<I32>& chunks, const Vector<U32>& sizes) {
+        for (size_t i = 0; i < chunks.size(); i++) {
+            journal.chunk_bytes[chunks[i]] = sizes[i];
+            ui.chunk_saved[chunks[i]] = ui.chunk_generation[chunks[i]];
+        }
+    }
+
+    // Rewrites the journal with a single record holding every chunk that differs from the base map.
+    static bool compact_journal(UI& ui) {
+        ByteWriter w;
+        write_header(ui, w, JOURNAL_MAGIC, ui.map_seed);
+        w.put<U8>(ui.map_from_seed);
+        size_t header_bytes = w.data.size();
+        Vector<I32> chunks;
+        for (I32 i = 0; i < (I32)journal.chunk_bytes.size(); i++) {
+            if (journal.chunk_bytes[i]) {
+                chunks.push_back(i);
+            }
+        }
+        Vector<U32> sizes = write_record(ui, w, chunks);
+        if (!write_file(journal.path, w.data)) {
+            return false;
+        }
+        commit_record(ui, chunks, sizes);
+        journal.records = 1;
+        journal.bytes = w.data.size();
+        journal.header_bytes = header_bytes;
+        return true;
+    }
+
+    // Appends the chunks changed since the last delta save to path. A new journal is started when path is not
+    // the current journal or the base map has been replaced since, it then holds every chunk that differs from
+    // the base. The journal is compacted after COMPACT_RECORDS saves or when it is twice as large as needed.
+    static bool save_delta(UI& ui, const String& path) {
+        if (!ui.tilemap_widget) {
+            return false;
+        }
+        bool fresh = journal.path != path || journal.revision != ui.map_revision || !std::filesystem::exists(path);
+        Vector<I32> chunks;
+        for (I32 i = 0; i < (I32)ui.chunk_generation.size(); i++) {
+            if (fresh ? !ui.map_from_seed || ui.chunk_edited[i] : ui.chunk_generation[i] != ui.chunk_saved[i]) {
+                chunks.push_back(i);
+            }
+        }
+        if (fresh) {
+            journal = WorldJournal();
+            journal.path = path;
+            journal.revision = ui.map_revision;
+            journal.chunk_bytes.assign(ui.chunk_generation.size(), 0);
+            for (I32 chunk : chunks) {
+                journal.chunk_bytes[chunk] = 1;
+            }
+            if (!compact_journal(ui)) {
+                forget_journal(path);
+                return false;
+            }
+            return true;
+        }
+        if (chunks.empty()) {
+            return true;
+        }
+        ByteWriter w;
+        Vector<U32> sizes = write_record(ui, w, chunks);
+        FILE* f = fopen(path.c_str(), "ab");
+        if (!f) {
+            return false;
+        }
+        bool ok = fwrite(w.data.data(), w.data.size(), 1, f) == 1;
+        if (fclose(f) != 0 || !ok) {
+            forget_journal(path);
+            return false;
+        }
+        commit_record(ui, chunks, sizes);
+        journal.records++;
+        journal.bytes += w.data.size();
+        size_t needed = journal.header_bytes;
+        for (U32 bytes : journal.chunk_bytes) {
+            needed += bytes ? bytes + 2 * sizeof(U32) : 0;
+        }
+        if (journal.records > COMPACT_RECORDS || journal.bytes > 2 * needed) {
+            return compact_journal(ui);
+        }
+        return true;
+    }
+
+    // A record cut short by a crash ends the journal, the file is truncated there so later saves append cleanly.
+    static bool load_journal(UI& ui, const String& path, const Vector<U8>& data) {
+        Header h;
+        ByteReader r(data.data() + sizeof(MAGIC), data.size() - sizeof(MAGIC));
+        bool ok = read_header(ui, r, h);
+        bool from_seed = r.get<U8>();
+        if (!ok || !r.ok) {
+            return false;
+        }
+        size_t header_bytes = r.p - data.data();
+        Size old_size = ui.map_size;
+        ui.map_size = h.map_size;
+        Size grid = ui.chunk_grid();
+        I32 count = LAYER_COUNT * grid.w * grid.h;
+        Vector<const U8*> latest(count, nullptr);
+        Vector<U32> latest_bytes(count, 0);
+        I32 records = 0;
+        const U8* end = r.p;
+        while (r.end - r.p >= (ptrdiff_t)sizeof(U32)) {
+            U32 record_bytes = r.get<U32>();
+            if ((size_t)(r.end - r.p) < record_bytes) {
+                break;
+            }
+            ByteReader record(r.p, record_bytes);
+            r.p += record_bytes;
+            U32 n = record.get<U32>();
+            for (U32 i = 0; record.ok && i < n; i++) {
+                U32 chunk = record.get<U32>();
+                U32 bytes = record.get<U32>();
+                if (!record.ok || chunk >= (U32)count || (size_t)(record.end - record.p) < bytes) {
+                    record.ok = false;
+                    break;
                 }
+                latest[chunk] = record.p;
+                latest_bytes[chunk] = bytes;
+                record.p += bytes;
+            }
+            if (!record.ok) {
+                ui.map_size = old_size;
+                return false;
+            }
+            records++;
+            end = r.p;
+        }
+
+        Vector<I32> edited;
+        for (I32 i = 0; i < count; i++) {
+            if (latest[i]) {
+                edited.push_back(i);
             }
         }
-    }
+        Vector<Vector<TextureID>> tiles(edited.size());
+        std::atomic<bool> inflated = true;
+        parallel_for(0, edited.size(), [&](int i) {
+            Box b = ui.chunk_box(edited[i] % (count / LAYER_COUNT));
+            tiles[i].resize((b.b.x - b.a.x) * (b.b.y - b.a.y));
+            if (!inflate_chunk(latest[edited[i]], latest_bytes[edited[i]], b, h.remap, tiles[i].data(), b.b.x - b.a.x)) {
+                inflated = false;
+            }
+        });
+        ui.map_size = old_size;
+        if (!inflated) {
+            return false;
+        }
+
+        apply_header(ui, h);
+        if (from_seed) {
+            ui.randomize_map(h.seed);
+        } else {
+            std::fill(ui.tiles_ground, ui.tiles_ground + h.map_size.w * h.map_size.h, 0);
+        }
+        for (size_t i = 0; i < edited.size(); i++) {
+            Box b = ui.chunk_box(edited[i] % (count / LAYER_COUNT));
+            TextureID* layer = ui.layer(edited[i] / (count / LAYER_COUNT));
+            I16 width = b.b.x - b.a.x;
+            for (I16 y = b.a.y; y < b.b.y; y++) {
+                std::copy(&tiles[i][(y - b.a.y) * width], &tiles[i][(y - b.a.y) * width] + width, layer + y * h.map_size.w + b.a.x);
+            }
+        }
+        ui.fix_camera();
+        ui.mark_dirty(Box(Point(0, 0), h.map_size));
+        ui.reset_chunks();
+        ui.map_seed = h.seed;
+        ui.map_from_seed = from_seed;
+        for (I32 chunk : edited) {
+            ui.chunk_edited[chunk] = 1;
+        }
 
-    void zoomin_cam() {
-        if (++zoom_idx >= sizeof(zoom_levels) / sizeof(*zoom_levels)) {
-            --zoom_idx;
-            return;
+        size_t valid = end - data.data();
+        std::error_code error;
+        if (valid < data.size()) {
+            std::filesystem::resize_file(path, valid, error);
         }
-        camera_pos.x = (camera_pos.x + size.w / 4) * 2;
-        camera_pos.y = (camera_pos.y + size.h / 4) * 2;
-        zoom = zoom_levels[zoom_idx];
-        fix_camera();
+        journal = WorldJournal();
+        journal.path = path;
+        journal.revision = ui.map_revision;
+        journal.records = records;
+        journal.bytes = valid;
+        journal.header_bytes = header_bytes;
+        journal.chunk_bytes = latest_bytes;
+        return true;
     }
+};
 
-    void zoomout_cam() {
-        if (--zoom_idx < 0) {
-            ++zoom_idx;
-            return;
-        }
-        camera_pos.x = (camera_pos.x - size.w / 2) / 2;
-        camera_pos.y = (camera_pos.y - size.h / 2) / 2;
-        zoom = zoom_levels[zoom_idx];
-        fix_camera();
-    }
 
-    void fix_camera() {
-        Camera camera_max = {(zoom * tile_dim.w) * map_size.w - size.w, (zoom * tile_dim.h) * map_size.h - size.h};
-        if (infinite_scrolling) {
-            while (camera_pos.x <= -camera_max.x) camera_pos.x += (camera_max.x + size.w);
-            while (camera_pos.y <= -camera_max.y) camera_pos.y += (camera_max.y + size.h);
-            while (camera_pos.x >= 2 * camera_max.x) camera_pos.x -= (camera_max.x + size.w);
-            while (camera_pos.y >= 2 * camera_max.y) camera_pos.y -= (camera_max.y + size.h);
-        } else {
-            if (camera_pos.x < 0) camera_pos.x = 0;
-            if (camera_pos.y < 0) camera_pos.y = 0;
-            camera_pos.x = camera_pos.x < camera_max.x ? camera_pos.x : camera_max.x;
-            camera_pos.y = camera_pos.y < camera_max.y ? camera_pos.y : camera_max.y;
-        }
+
+
+// Embedded Lua runtime. Scripts get an "engine" table with bindings for widgets, the tilemap, input,
+// audio and textures and can register per-frame callbacks, so hot logic runs without crossing the FFI.
+struct Script {
+    Script() {
+        L = luaL_newstate();
+        luaL_openlibs(L);
+        static const luaL_Reg functions[] = {
+            {"now", now_us},
+            {"on_frame", on_frame},
+            {"create_widget", create_widget},
+            {"add_widget", add_widget},
+            {"remove_widget", remove_widget},
+            {"set_texture", set_texture},
+            {"set_text", set_text},
+            {"on_click", on_click},
+            {"on_hover", on_hover},
+            {"set_tile", set_tile},
+            {"get_tile", get_tile},
+            {"fill_tiles", fill_tiles},
+            {"pick_tile", pick_tile},
+            {"map_size", map_size},
+            {"move_camera", move_camera},
+            {"zoom_in", zoom_in},
+            {"zoom_out", zoom_out},
+            {"bind_key", bind_key},
+            {"mouse_pos", mouse_pos},
+            {"shift_held", shift_held},
+            {"play_sound", play_sound},
+            {"stop_sound", stop_sound},
+            {"play_music", play_music},
+            {"stop_music", stop_music},
+            {"texture_id", texture_id},
+            {"texture_registered", texture_registered},
+            {"spawn", spawn},
+            {"wait_frame", wait_frame},
+            {"sleep", sleep},
+            {"wait_event", wait_event},
+            {"signal", signal},
+            {nullptr, nullptr}
+        };
+        luaL_newlib(L, functions);
+        lua_setglobal(L, "engine");
     }
 
-    void move_cam(Point p) {
-        if ((p.x != 0 && move_vector.x == 0)) {
-            move_vector.x = p.x;
-        } 
-        if ((p.y != 0 && move_vector.y == 0)) {
-            move_vector.y = p.y;
-        }
+    ~Script() { lua_close(L); }
+
+    bool run(const String& code, const String& chunkname) {
+        return check(luaL_loadbuffer(L, code.c_str(), code.size(), chunkname.c_str()) == LUA_OK && lua_pcall(L, 0, 0, 0) == LUA_OK);
     }
 
-    void move_cam_to_tile(Point tile_pos) {
-        camera_pos = {tile_pos.x * tile_dim.w * zoom, tile_pos.y * tile_dim.h * zoom};
-        Box visible = visible_tiles();
-        Camera mid = {zoom * tile_dim.w * (visible.b.x - visible.a.x) / 2, zoom * tile_dim.h * (visible.b.y - visible.a.y) / 2};
-        camera_pos = camera_pos - mid;
-        fix_camera();
+    bool run_file(const String& path) { return check(luaL_dofile(L, path.c_str()) == LUA_OK); }
+
+    bool call_global(const String& name) {
+        lua_getglobal(L, name.c_str());
+        return check(lua_pcall(L, 0, 0, 0) == LUA_OK);
     }
 
-    Widget* create_tilemap(Size widget_size, Size tilemap_size, Size tile_size) {
-        tilemap_widget = new Widget(widget_size);
-        map_size = tilemap_size;
-        tile_dim = tile_size;
-        tiles_ground = new TextureID[map_size.w * map_size.h];
-        std::memset(tiles_ground, 0, map_size.w * map_size.h * sizeof(TextureID));
-        return tilemap_widget;
+    void call_ref(int ref) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+        check(lua_pcall(L, 0, 0, 0) == LUA_OK);
     }
 
-    void set_tile(I16 x, I16 y, const String& texture_name, bool ground) {
-        if (ground) {
-            tiles_ground[y * map_size.w + x] = name_to_texture[texture_name]->id;
+    void update() {
+        for (int ref : frame_callbacks) {
+            call_ref(ref);
         }
+        schedule();
     }
 
-    UI(Size s) {
-        size = s;
-        if (!window) {
-            #ifdef _WIN32
-            SDL_setenv("SDL_AUDIODRIVER", "directsound", true); 
-            #endif
-            SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO);
-            window = SDL_CreateWindow("", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, s.w, s.h, 0);
-            //if (fullscreen) {
-            //    SDL_SetWindowFullscreen(window, SDL_WINDOW_FULLSCREEN);
-            //}
+    // Coroutine scheduler: tasks spawned with engine.spawn yield until the next frame (wait_frame or a plain
+    // coroutine.yield), a timeout (sleep) or an event (wait_event). Ready tasks are resumed once per frame until
+    // the budget is used up, at least one always runs and the ones left over go first on the next frame.
+    struct Task {
+        enum Wait {FRAME, TIME, EVENT};
+        lua_State* co;
+        int ref;
+        int nargs;
+        Wait wait = FRAME;
+        long long until = 0;
+        String event;
+        bool signaled = false;
+    };
+
+    // First value of the yields made by sleep and wait_event, anything else a task yields means wait a frame.
+    static inline char wait_tag = 0;
+
+    bool ready(const Task& t) {
+        switch (t.wait) {
+            case Task::TIME: return now() >= t.until;
+            case Task::EVENT: return t.signaled;
+            default: return true;
         }
-        pixels = (Color*)SDL_GetWindowSurface(window)->pixels;
     }
 
-    void update() {
-        std::vector<Widget*> widgets(top_widgets);
-        I32 idx = 0;
-        while (idx < widgets.size()) {
-            Widget* w = widgets[idx];
-            if (w->remove) {
-                if (w->parent) {
-                    vector_remove(w->parent->children, w);
-                } else {
-                    vector_remove(top_widgets, w);
-                }
-                delete w;
-                ++idx;
+    void schedule() {
+        long long start = now();
+        size_t n = tasks.size();
+        size_t i = 0;
+        bool resumed = false;
+        for (; i < n; i++) {
+            if (!ready(tasks[i])) {
                 continue;
             }
-            if (w->texture) {
-                blit(w->texture->pixels, w->texture->size, w->pos, Box(w->pos, w->size), w->texture->transparent);
-            }
-            if (w == tilemap_widget) {
-                draw_tilemap();
-            }
-            Point p = w->pos + w->letters_offset;
-            for (auto& line : w->letters) {
-                I16 line_height = 0;
-                for (Texture* letter : line) {
-                    blit(letter->pixels, letter->size, p, Box(w->pos, w->size), true);
-                    p.x += letter->size.w;
-                    line_height = letter->size.h > line_height ? letter->size.h : line_height;
-                }
-                p.x = w->pos.x;
-                p.y += line_height;
-            }
-            for (Widget* child : w->children) {
-                widgets.push_back(child);
+            if (resumed && now() - start >= budget_us) {
+                break;
             }
-            ++idx;
+            resume(i);
+            resumed = true;
         }
-        long long t_now = now();
-        long long t = t_now - last_update;
-        SDL_UpdateWindowSurface(window);
-        fps = t > 0 ? (double) 1 / ((double)now() / (1000 * 1000)) : 0; 
-        last_update = now();
+        std::rotate(tasks.begin(), tasks.begin() + i, tasks.begin() + n);
+        tasks.erase(std::remove_if(tasks.begin(), tasks.end(), [](const Task& t) { return !t.co; }), tasks.end());
     }
 
-    void load_letters(int height, Color color) {
-        String fontpath = "./mono.ttf";
-        letter_to_texture[height].resize(LETTER_MAX + 1);
-        unsigned char* ttf_buffer = new unsigned char[1<<25];
-        FILE* fontfile = fopen(fontpath.c_str(), "rb");
-        fread(ttf_buffer, 1, 1<<25, fontfile);
-        fclose(fontfile);
-        stbtt_fontinfo font;
-        stbtt_InitFont(&font, ttf_buffer, stbtt_GetFontOffsetForIndex(ttf_buffer,0));
-        float scale = stbtt_ScaleForPixelHeight(&font, (float)height);
-        int ascent, descent, lineGap;
-        stbtt_GetFontVMetrics(&font, &ascent, &descent, &lineGap);  
-        ascent = roundf(ascent * scale);
-        descent = roundf(descent * scale);
-        for (char c = LETTER_MIN; c < LETTER_MAX; c++) {
-            int leftSideBearing;
-            int advanceWidth;
-            stbtt_GetCodepointHMetrics(&font, c, &advanceWidth, &leftSideBearing);
-            advanceWidth *= c == ' ' ? scale : 0;
-            leftSideBearing *= scale;
-            int c_x1, c_y1, c_x2, c_y2;
-            stbtt_GetCodepointBitmapBox(&font, c, scale, scale, &c_x1, &c_y1, &c_x2, &c_y2);
-            int y_char = ascent + c_y1;
-            int w = c_x2 - c_x1;
-            int h = c_y2 - c_y1;
-            unsigned char* bitmap = new unsigned char[w * h];
-            stbtt_MakeCodepointBitmap(&font, bitmap, w, h, w, scale, scale, c);
-            Size s(w + leftSideBearing + advanceWidth, y_char + h);
-            Color* out = new Color[s.w * s.h];
-            for (int y = y_char; y < s.h; y++) {
-                for (int x = leftSideBearing; x < w + leftSideBearing; x++) {
-                    out[y * s.w + x] = color;
-                    out[y * s.w + x].alpha = bitmap[(y - y_char) * w + (x - leftSideBearing)];
+    void resume(size_t i) {
+        lua_State* co = tasks[i].co;
+        int nres = 0;
+        int status = lua_resume(co, L, tasks[i].nargs, &nres);
+        Task& t = tasks[i]; // resuming may spawn tasks and reallocate
+        t.nargs = 0;
+        t.wait = Task::FRAME;
+        t.signaled = false;
+        if (status == LUA_YIELD) {
+            int base = lua_gettop(co) - nres + 1;
+            if (nres == 3 && lua_touserdata(co, base) == &wait_tag) {
+                t.wait = (Task::Wait)lua_tointeger(co, base + 1);
+                if (t.wait == Task::TIME) {
+                    t.until = lua_tointeger(co, base + 2);
+                } else if (t.wait == Task::EVENT) {
+                    t.event = lua_tostring(co, base + 2);
                 }
             }
-            delete[] bitmap;
-            letter_to_texture[height][c] = new Texture(out, s, true);
+            lua_pop(co, nres);
+            return;
         }
-        delete[] ttf_buffer;
+        if (status != LUA_OK) {
+            lua_xmove(co, L, 1);
+            check(false);
+        }
+        luaL_unref(L, LUA_REGISTRYINDEX, t.ref);
+        t.co = nullptr;
     }
 
-    void register_texture(const String& name, Texture* t, bool scale) {
-        if (name_to_texture.find(name) != name_to_texture.end()) {
-            return;
+    void signal(const String& event) {
+        for (auto& t : tasks) {
+            if (t.co && t.wait == Task::EVENT && t.event == event) {
+                t.signaled = true;
+            }
         }
-        id_to_texture[currentID] = t;
-        name_to_texture[name] = t;
-        t->id = currentID;
-        currentID++;
     }
 
-    Texture* get(const std::string& name) {
-        if (name_to_texture.find(name) != name_to_texture.end()) {
-            return name_to_texture[name]; 
+    bool check(bool ok) {
+        if (!ok) {
+            print(String("lua: ") + (lua_isstring(L, -1) ? lua_tostring(L, -1) : "error"));
+            lua_pop(L, 1);
         }
-        return nullptr;
+        return ok;
     }
 
-    Texture* get(char letter, int size) {
-        if (letter_to_texture[size].empty()) {
-            load_letters(size, Color(255, 255, 255, 255));
-        }
-        return letter_to_texture[size][letter]; 
+    static Script* self(lua_State* L) {
+        lua_getfield(L, LUA_REGISTRYINDEX, "engine_script");
+        Script* s = (Script*)lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return s;
     }
 
-    void blit(Color* texture, Size texture_size, Point start, Box canvas, bool transparent=false, float zoom=1.0f) {
-        Point texture_end(start.x + texture_size.w, start.y + texture_size.h);
-        Point texture_start(0, 0);
-        Point texture_endcut(0, 0);
-        if (start.x < canvas.a.x) {
-            texture_start.x = (canvas.a.x - start.x);
-            start.x = canvas.a.x;
-        } else if (texture_end.x > canvas.b.x) {
-            texture_endcut.x = texture_end.x - canvas.b.x;
-        }
-        if (start.y < canvas.a.y) {
-            texture_start.y = (canvas.a.y - start.y);
-            start.y = canvas.a.y;
-        } else if (texture_end.y > canvas.b.y) {
-            texture_endcut.y = texture_end.y - canvas.b.y;
-        }
-        
-        unsigned* texture_pixels = (unsigned*)(texture + (unsigned)(texture_start.x / zoom)); 
-        unsigned* screen_pixels = (unsigned*)(pixels + start.y * size.w + start.x);
-        I16 upper_bound_x = texture_size.w - texture_start.x - texture_endcut.x;
-        I16 upper_bound_y = texture_size.h - texture_start.y - texture_endcut.y;
-        if (upper_bound_y <= 0 || upper_bound_x <= 0) {
-            return;
-        }
-        
-        if (transparent) {
-            for (I16 y = 0; y < upper_bound_y; y++) {
-                for (I16 x = 0; x < upper_bound_x; x++) {
-                    unsigned color1 = screen_pixels[y * size.w + x];
-                    unsigned color2 = texture_pixels[int(y / zoom) * int(texture_size.w / zoom) + int(x / zoom)];
-                    unsigned rb = (color1 & 0xff00ff) + (((color2 & 0xff00ff) - (color1 & 0xff00ff)) * ((color2 & 0xff000000) >> 24) >> 8);
-                    unsigned g  = (color1 & 0x00ff00) + (((color2 & 0x00ff00) - (color1 & 0x00ff00)) * ((color2 & 0xff000000) >> 24) >> 8);
-                    screen_pixels[y * size.w + x] = (rb & 0xff00ff) | (g & 0x00ff00);
-                }
-            }
-        } else {
-           for (I16 y = 0; y < upper_bound_y; y++) {
-                for (I16 x = 0; x < upper_bound_x; x++) {
-                    screen_pixels[y * size.w + x] = texture_pixels[int(y / zoom) * int(texture_size.w / zoom) + int(x / zoom)];
-                }
-           }
-        }
-        
+    static int ref_function(lua_State* L, int idx) {
+        luaL_checktype(L, idx, LUA_TFUNCTION);
+        lua_pushvalue(L, idx);
+        return luaL_ref(L, LUA_REGISTRYINDEX);
     }
 
-    void add_widget(Widget* parent, Widget* child, Point offset) {
-        if (!parent) {
-            child->pos = offset;
-            top_widgets.push_back(child);
-            return;
+    // The function stays referenced as long as the returned callback, so a removed widget releases it.
+    static std::function<void()> callback(lua_State* L, int idx) {
+        Script* s = self(L);
+        std::shared_ptr<int> ref(new int(ref_function(L, idx)), [s](int* r) {
+            luaL_unref(s->L, LUA_REGISTRYINDEX, *r);
+            delete r;
+        });
+        return [s, ref]() { s->call_ref(*ref); };
+    }
+
+    static Widget* widget(lua_State* L, int idx) {
+        luaL_checktype(L, idx, LUA_TLIGHTUSERDATA);
+        return (Widget*)lua_touserdata(L, idx);
+    }
+
+    static I16 arg(lua_State* L, int idx) { return (I16)luaL_checkinteger(L, idx); }
+
+    static int now_us(lua_State* L) { lua_pushinteger(L, now()); return 1; }
+    static int on_frame(lua_State* L) { self(L)->frame_callbacks.push_back(ref_function(L, 1)); return 0; }
+
+    static int create_widget(lua_State* L) { lua_pushlightuserdata(L, new Widget({arg(L, 1), arg(L, 2)})); return 1; }
+    static int add_widget(lua_State* L) {
+        g_ui->add_widget(lua_isnil(L, 1) ? nullptr : widget(L, 1), widget(L, 2), {arg(L, 3), arg(L, 4)});
+        return 0;
+    }
+    static int remove_widget(lua_State* L) { widget(L, 1)->remove = true; return 0; }
+    static int set_texture(lua_State* L) { g_ui->set_texture(widget(L, 1), luaL_checkstring(L, 2)); return 0; }
+    static int set_text(lua_State* L) {
+        g_ui->set_text(widget(L, 1), luaL_checkstring(L, 2), arg(L, 3), {(I16)luaL_optinteger(L, 4, 0), (I16)luaL_optinteger(L, 5, 0)});
+        return 0;
+    }
+    static int on_click(lua_State* L) {
+        Widget* w = widget(L, 1);
+        w->listener = new Input::Listener(callback(L, 2));
+        g_input->add_mouse_listener(w->listener, Box(w->pos, w->size), false, w->depth());
+        return 0;
+    }
+    static int on_hover(lua_State* L) {
+        Widget* w = widget(L, 1);
+        w->hover_listener = new Input::Listener(callback(L, 2));
+        g_input->add_hover_listener(w->hover_listener, Box(w->pos, w->size), w->depth());
+        return 0;
+    }
+
+    static void check_tilemap(lua_State* L) {
+        if (!g_ui->tiles_ground) {
+            luaL_error(L, "no tilemap has been created");
         }
-        std::function<void(Widget*, Point)> offset_position = [&](Widget* w, Point offset) {
-            w->pos = w->pos + offset;
-            for (auto& child : w->children) {
-                offset_position(child, offset);
-            }
-            return;
-        };
-        offset_position(child, parent->pos + offset);
-        parent->children.push_back(child);
-        child->parent = parent;
     }
 
-    void set_texture(Widget* w, const String& name) {
-        w->texture = name_to_texture[name];
+    static int set_tile(lua_State* L) {
+        check_tilemap(L);
+        TextureID id = arg(L, 3);
+        g_ui->set_tiles(&id, {arg(L, 1), arg(L, 2)}, {1, 1});
+        return 0;
+    }
+    static int get_tile(lua_State* L) {
+        check_tilemap(L);
+        Point p(arg(L, 1), arg(L, 2), g_ui->map_size);
+        lua_pushinteger(L, g_ui->tiles_ground[p.y * g_ui->map_size.w + p.x]);
+        return 1;
+    }
+    static int fill_tiles(lua_State* L) {
+        check_tilemap(L);
+        g_ui->fill_tiles({arg(L, 1), arg(L, 2)}, {arg(L, 3), arg(L, 4)}, arg(L, 5));
+        return 0;
     }
+    static int pick_tile(lua_State* L) {
+        Point p = g_ui->pick_tile({arg(L, 1), arg(L, 2)});
+        if (p.x < 0) {
+            return 0;
+        }
+        lua_pushinteger(L, p.x);
+        lua_pushinteger(L, p.y);
+        return 2;
+    }
+    static int map_size(lua_State* L) { lua_pushinteger(L, g_ui->map_size.w); lua_pushinteger(L, g_ui->map_size.h); return 2; }
+    static int move_camera(lua_State* L) { g_ui->move_cam({arg(L, 1), arg(L, 2)}); return 0; }
+    static int zoom_in(lua_State*) { g_ui->zoomin_cam(); return 0; }
+    static int zoom_out(lua_State*) { g_ui->zoomout_cam(); return 0; }
+
+    static int bind_key(lua_State* L) { g_input->add_key_listeners(new Input::Listener(callback(L, 2)), {luaL_checkstring(L, 1)}); return 0; }
+    static int mouse_pos(lua_State* L) {
+        Point p = g_input->mouse_pos();
+        lua_pushinteger(L, p.x);
+        lua_pushinteger(L, p.y);
+        return 2;
+    }
+    static int shift_held(lua_State* L) { lua_pushboolean(L, g_input->shift_held()); return 1; }
 
-    void set_text(Widget* w, const String& txt, I16 txt_height, Point offset) {
-        w->letters_offset = offset;
-        Vector<Vector<Texture*>>& lines = w->letters;
-        lines.clear();
-        lines.resize(1);
-        std::vector<Texture*> word;
-        int current_line = 0;
-        short word_length = 0;
-        short line_length = 0;
-        short line_height = 0;
-        short total_height = 0;
+    static int play_sound(lua_State* L) {
+        g_audio->play_wav(luaL_checkstring(L, 1), false, luaL_optnumber(L, 2, 1.0), luaL_optnumber(L, 3, 0.0), luaL_optinteger(L, 4, 0));
+        return 0;
+    }
+    static int stop_sound(lua_State* L) { g_audio->stop_wav(luaL_checkstring(L, 1)); return 0; }
+    static int play_music(lua_State* L) {
+        g_audio->play_music(luaL_checkstring(L, 1), luaL_optinteger(L, 2, 0), lua_isnone(L, 3) || lua_toboolean(L, 3));
+        return 0;
+    }
+    static int stop_music(lua_State* L) { g_audio->stop_music(luaL_optinteger(L, 1, 0)); return 0; }
 
-        for (int i = 0; i < (int)txt.size(); i++) {
-            bool newline = i < (int)txt.size()-1 ? txt[i] == 10 : false;
-            if (newline) {
-                total_height += line_height;
-                lines[current_line].insert(lines[current_line].end(), word.begin(), word.end());
-                lines.push_back(std::vector<Texture*>());
-                line_length = 0;
-                line_height = 0;
-                current_line++;
-                word.clear();
-                word_length = 0;
-                continue;
-            }
-            Texture* t = get(txt[i], txt_height);
-            if (t) {
-                word.push_back(t);
-                word_length += t->size.w;
-                line_height = t->size.h > line_height ? t->size.h : line_height;
-            }
-            if (txt[i] == ' ' || i == (int)(txt.size()-1)) {
-                if (line_length + word_length < w->size.w) {
-                    lines[current_line].insert(lines[current_line].end(), word.begin(), word.end());
-                    line_length += word_length;
-                } else {
-                    total_height += line_height;
-                    if (total_height + line_height > w->size.h) { 
-                        //std::cout << "Text too long!" << std::endl;
-                        // add excess text handling here
-                        break;
-                    }
-                    lines.push_back(word);
-                    line_length = word_length;
-                    line_height = 0;
-                    current_line++;
-                }
-                word.clear();
-                word_length = 0;
-            }
+    static int texture_id(lua_State* L) {
+        Texture* t = g_ui->get(luaL_checkstring(L, 1));
+        lua_pushinteger(L, t ? t->id : 0);
+        return 1;
+    }
+    static int texture_registered(lua_State* L) { lua_pushboolean(L, g_ui->get(luaL_checkstring(L, 1)) != nullptr); return 1; }
+
+    static int spawn(lua_State* L) {
+        luaL_checktype(L, 1, LUA_TFUNCTION);
+        int nargs = lua_gettop(L) - 1;
+        lua_State* co = lua_newthread(L);
+        int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+        for (int i = 1; i <= nargs + 1; i++) {
+            lua_pushvalue(L, i);
         }
+        lua_xmove(L, co, nargs + 1);
+        self(L)->tasks.push_back({co, ref, nargs});
+        return 0;
+    }
+    static int wait_frame(lua_State* L) { return lua_yield(L, 0); }
+    static int sleep(lua_State* L) {
+        lua_Integer until = now() + (lua_Integer)(luaL_checknumber(L, 1) * 1000);
+        lua_pushlightuserdata(L, &wait_tag);
+        lua_pushinteger(L, Task::TIME);
+        lua_pushinteger(L, until);
+        return lua_yield(L, 3);
     }
+    static int wait_event(lua_State* L) {
+        luaL_checkstring(L, 1);
+        lua_pushlightuserdata(L, &wait_tag);
+        lua_pushinteger(L, Task::EVENT);
+        lua_pushvalue(L, 1);
+        return lua_yield(L, 3);
+    }
+    static int signal(lua_State* L) { self(L)->signal(luaL_checkstring(L, 1)); return 0; }
 
-    struct Anchor {
-        static constexpr int PERC_FACTOR = 100000;
-        Anchor(Point p, double pc, char t): pos(p), perc(PERC_FACTOR * pc), temp(t) {}
-        Point pos;
-        long long perc;
-        char temp;
-    };
+    lua_State* L = nullptr;
+    Vector<int> frame_callbacks;
+    Vector<Task> tasks;
+    long long budget_us = 2000;
+};
 
-    void randomize_map() {
-        MapConfig& config = *map_config;
-        Size num_cells = {config.num_cells, config.num_cells};
-        Size cell_size = map_size / num_cells;
-        int max_samples = cell_size.w * cell_size.h * config.sample_factor; // 3
-        int sample_dist = config.sample_distance; // 2
-        
-        char* heightmap = new char[map_size.w * map_size.h];
-        std::memset(heightmap, 0, map_size.w * map_size.h);
-        MapConfig::Biome& mountain_biome = config.elevations.back().biomes[0];
-        unsigned char max_height = mountain_biome.max_height - 1;
-        F32 height_cutoff = 1 - config.elevations.back().perc;
-        short wall_height = mountain_biome.wall_height;
+static Script* g_script = nullptr;
 
-        const int climate_cluster_factor = 4;
-        double r;
-        Vector<Anchor> anchors;
-        for (short y = 0; y < num_cells.h; y++) {
-            for (short x = 0; x < num_cells.w; x++) {
-                if (x % climate_cluster_factor == 0 && y % climate_cluster_factor == 0) {
-                    r = random_uniform(20, 80);
-                } else {
-                    short use_x = x - (x % climate_cluster_factor);
-                    short use_y = (y - (y % climate_cluster_factor)) * num_cells.w; 
-                    r = anchors[use_y + use_x].temp;
-                }
-                anchors.emplace_back(
-                    Point((x + random_fast()) * cell_size.w, (y + random_fast()) * cell_size.h), 
-                    random_fast(),
-                    r
-                ); 
-            }
+static Script* script() {
+    if (!g_script) {
+        g_script = new Script();
+        lua_pushlightuserdata(g_script->L, g_script);
+        lua_setfield(g_script->L, LUA_REGISTRYINDEX, "engine_script");
+    }
+    return g_script;
+}
+
+
+
+//
+// Main loop: input, scripts and the camera advance in fixed ticks, rendering is paced separately
+//
+
+enum FrameLimit { FRAME_UNCAPPED = 0, FRAME_VSYNC = -1 };
+
+struct Loop {
+    static inline constexpr I32 MAX_CATCHUP_TICKS = 5;
+    long long tick_us = 1000000 / 60;
+    long long frame_us = 0;
+    I32 frame_limit = FRAME_VSYNC;
+
+    void set_frame_limit(I32 limit) {
+        frame_limit = limit;
+        frame_us = 0;
+        if (limit > 0) {
+            frame_us = 1000000 / limit;
+        } else if (limit == FRAME_VSYNC) {
+            SDL_DisplayMode mode;
+            int display = g_ui->window ? SDL_GetWindowDisplayIndex(g_ui->window) : 0;
+            bool known = SDL_GetCurrentDisplayMode(display < 0 ? 0 : display, &mode) == 0 && mode.refresh_rate > 0;
+            frame_us = 1000000 / (known ? mode.refresh_rate : 60);
         }
-        /*
-        for (short y_map = 0; y_map < map_size.h; y_map++) {
-            for (short x_map = 0; x_map < map_size.w; x_map++) {
-                tiles_ground->get(x_map, y_map) = 0;
-                tiles_above->get(x_map, y_map) = 0;
-                heightmap->get(x_map, y_map) = 0;
-            }
+    }
+
+    void tick() {
+        {
+            ProfileScope scope(STAGE_INPUT);
+            g_input->handleInputs();
         }
-        */
-        //parallel_for(0, num_cells.h-1, [&](int y_cell) {
-        for (I16 y_cell = 0; y_cell < num_cells.h; y_cell++) {        
-            for (I16 x_cell = 0; x_cell < num_cells.w; x_cell++) {
-                Box sample_cells(Point(x_cell - sample_dist, y_cell - sample_dist), Point(x_cell + sample_dist, y_cell + sample_dist));
-                Vector<Anchor> current_anchors;
-                for (short y_cells = sample_cells.a.y; y_cells <= sample_cells.b.y; y_cells++) {
-                    for (short x_cells = sample_cells.a.x; x_cells <= sample_cells.b.x; x_cells++) {
-                        short x_cur = x_cells;
-                        short x_offset = 0;
-                        if (x_cur < 0) {
-                            x_offset = -map_size.w;
-                            x_cur += num_cells.w;
-                        } else if (x_cur > num_cells.w - 1) {
-                            x_offset = map_size.w;
-                            x_cur -= num_cells.w;
-                        }
-                        short y_cur = y_cells;
-                        short y_offset = 0;
-                        if (y_cur < 0) {
-                            y_offset = -map_size.h;
-                            y_cur += num_cells.h;
-                        } else if (y_cur > num_cells.h - 1) {
-                            y_offset = map_size.h;
-                            y_cur -= num_cells.h;
-                        }
-                        current_anchors.emplace_back(anchors[y_cur * num_cells.w + x_cur]);
-                        current_anchors.back().pos.x += x_offset;
-                        current_anchors.back().pos.y += y_offset;
-                    }
-                }
-                for (I16 y_map = y_cell * cell_size.h; y_map < (I16)((y_cell + 1) * cell_size.h); y_map++) {
-                    for (I16 x_map = x_cell * cell_size.w; x_map < (I16)((x_cell + 1) * cell_size.w); x_map++) {
-                        unsigned long long sum_val = 0;
-                        unsigned long long sum_temp = 0;
-                        unsigned long long total_samples = 0;
-                        for (int i = 0; i < (int)current_anchors.size(); i++) {
-                            int diffx = current_anchors[i].pos.x - x_map;
-                            int diffy = current_anchors[i].pos.y - y_map;
-                            int dist = ((diffx ^ (diffx >> 31)) - (diffx >> 31)) + ((diffy ^ (diffy >> 31)) - (diffy >> 31));
-                            int num_samples = max_samples - dist * dist;
-                            num_samples = 1 + (num_samples & -((num_samples >> 31) ^ 1));
-                            sum_val += num_samples * current_anchors[i].perc;
-                            sum_temp += num_samples * current_anchors[i].temp;
-                            total_samples += num_samples;
-                        }
-                        double total_val = (double)sum_val / (total_samples * Anchor::PERC_FACTOR);
-                        double total_temp = (double)sum_temp / total_samples;
+        if (g_script) {
+            TRACE_ZONE("scripts");
+            g_script->update();
+        }
+        g_ui->tick();
+        World::poll_autosave(*g_ui);
+    }
 
-                        double current_val = 0;
-                        for (MapConfig::Elevation& elevation : config.elevations) {
-                            current_val += elevation.perc;
-                            if (total_val - current_val <= 0.001) {
-                                int biome_index = 0;
-                                if (elevation.biomes.size() > 1) {
-                                    for (biome_index = 0; biome_index < (int)elevation.biomes.size()-1; biome_index++) {
-                                        if (total_temp < elevation.temperatures[biome_index]) {
-                                            break;
-                                        }
-                                    }
-                                }
-                                MapConfig::Biome& biome = elevation.biomes[biome_index];
-                                if (biome.max_height > 0) {
-                                    char height = max_height * (total_val - height_cutoff) / (1 - height_cutoff);
-                                    heightmap[y_map * map_size.w + x_map] = height < 0 ? 0 : height;
-                                }
-                                if (biome.id < 0) {
-                                    Texture* t = get(biome.name);
-                                    biome.id = t->id;
-                                }
-                                tiles_ground[y_map * map_size.w + x_map] = biome.id;
-                                //map->set_ground(biome.id(), {x_map, y_map}, biome.blocking);
-                                double val = random_fast();
-                                current_val = 0;
-                                for (auto& item : biome.items) {
-                                    current_val += item.perc;
-                                    if (val - current_val <= 0.01) {
-                                        if (item.id < 0) {
-                                            Texture* t = get(item.name);
-                                            item.id = t->id;
-                                            item.size = t->size;
-                                        }
-                                        //map->set_tile(item.id(), {x_map, y_map}, item.size() / tile_dim);
-                                        break;
-                                    }
-                                }
-                                break;
-                            }
-                        }
-                    }
-                }
+    // Ticks that fall behind by more than MAX_CATCHUP_TICKS (e.g. during map generation) are dropped
+    // instead of being replayed in a burst.
+    void run() {
+        set_frame_limit(frame_limit);
+        long long previous = now();
+        long long lag = tick_us;
+        long long next_frame = previous;
+        while(1) {
+            long long t = now();
+            lag = std::min(lag + t - previous, MAX_CATCHUP_TICKS * tick_us);
+            previous = t;
+            while (lag >= tick_us) {
+                tick();
+                lag -= tick_us;
             }
-        }
-        TextureID mountain_id = get(mountain_biome.name_wall)->id;
-        for (I16 y_map = 1; y_map < map_size.h - wall_height; y_map++) {
-            for (I16 x_map = 1; x_map < map_size.w - 1; x_map++) {
-                if (heightmap[y_map * map_size.w + x_map] > heightmap[(y_map+1) * map_size.w + x_map]) {
-                    for (int i = 1; i <= wall_height; i++) { 
-                        tiles_ground[(y_map + i) * map_size.w + x_map] = mountain_id;
-                    }
-                }
+            g_ui->update();
+            if (frame_us > 0) {
+                next_frame = std::max(next_frame + frame_us, now() - frame_us);
+                wait_until(next_frame);
             }
         }
     }
 };
 
-static UI* g_ui = nullptr;
+static Loop g_loop;
 
 
 
@@ -1071,22 +4293,78 @@ static UI* g_ui = nullptr;
 extern "C" {
 
 void init(I16 width, I16 height) {
+    Tracer::thread_name = "main";
     g_audio = new Audio();
-    g_input = new Input();
+    g_input = new Input({width, height});
     g_ui = new UI({width, height});
 }
 
-void run() {
-    while(1) {
-        g_input->handleInputs();
-        g_ui->update();
+// No window, input polling or audio device: frames go to framebuffer_ptr() and input only comes from replays.
+void init_headless(I16 width, I16 height) {
+    Tracer::thread_name = "main";
+    g_audio = new Audio();
+    g_audio->headless = true;
+    g_input = new Input({width, height});
+    g_input->headless = true;
+    g_ui = new UI({width, height}, true);
+}
+
+void run() { g_loop.run(); }
+
+void set_tick_rate(I32 hz) {
+    if (hz > 0) {
+        g_loop.tick_us = 1000000 / hz;
+    }
+}
+
+// Frames per second to render at, 0 renders as fast as possible and -1 follows the display refresh rate.
+void set_frame_limit(I32 fps) { g_loop.set_frame_limit(fps); }
+
+// Stage timings in milliseconds over the last Profiler::HISTORY frames, stages are listed in ProfileStage.
+bool profiler_get_stats(I32 stage, ProfileStats* out) {
+    if (stage < 0 || stage >= STAGE_COUNT) {
+        return false;
     }
+    *out = g_profiler.stats(stage);
+    return true;
+}
+
+// width * height BGRA pixels of the last rendered frame.
+Color* framebuffer_ptr() { return g_ui->pixels; }
+
+bool save_frame(const char* path) { return g_ui->save_frame(path); }
+
+void render_frame() { g_ui->update(); }
+
+void profiler_show(bool show) { g_ui->show_profiler(show); }
+
+// Progress (0 to 1) of the running autosave and the duration of the last one, true while one is running.
+bool profiler_get_autosave(F32* progress, F32* last_ms) {
+    I32 chunks = g_profiler.autosave_chunks;
+    *progress = chunks ? (F32)g_profiler.autosave_chunks_written / chunks : 0;
+    *last_ms = g_profiler.autosave_us / 1000.0f;
+    return g_profiler.autosave_running;
 }
 
+void trace_begin() { g_tracer.begin(); }
+
+void trace_end() { g_tracer.end(); }
+
+// Writes the zones of the last session as Chrome trace event JSON (chrome://tracing, Perfetto).
+bool trace_export(const char* path) { return g_tracer.export_json(path); }
+
 
 
 void bind_key(const char* key, void (*action)()) { g_input->add_key_listeners(new Input::Listener(action), {key}); }
 
+void set_seed(unsigned seed) { random_seed(seed); }
+
+bool input_record(const char* path) { return g_input->start_recording(path); }
+
+void input_record_stop() { g_input->stop_recording(); }
+
+bool input_replay(const char* path, bool exit_at_end) { return g_input->start_replay(path, exit_at_end); }
+
 
 
 
@@ -1102,7 +4380,12 @@ void set_widget_text(Widget* w, const char* text, I16 text_height, I16 offset_x,
 
 void set_widget_callback(Widget* w, void (*f)()) {
     w->listener = new Input::Listener(f);
-    g_input->add_mouse_listener(w->listener, Box(w->pos, w->size));
+    g_input->add_mouse_listener(w->listener, Box(w->pos, w->size), false, w->depth());
+}
+
+void set_widget_hover_callback(Widget* w, void (*f)()) {
+    w->hover_listener = new Input::Listener(f);
+    g_input->add_hover_listener(w->hover_listener, Box(w->pos, w->size), w->depth());
 }
 
 
@@ -1117,10 +4400,70 @@ void tilemap_zoomin() { g_ui->zoomin_cam(); }
 
 void tilemap_zoomout() { g_ui->zoomout_cam();}
 
+int tilemap_pick(I16 x, I16 y) { return g_ui->pick_tile({x, y}); }
+
+I32 tilemap_pick_rect(I16 x0, I16 y0, I16 x1, I16 y1, I32* out, I32 capacity) { return g_ui->pick_tiles(Box(Point(x0, y0), Point(x1, y1)), out, capacity); }
+
 void tilemap_randomize() { g_ui->randomize_map(); }
 
+bool world_save(const char* path) { return World::save(*g_ui, path); }
+
+bool world_load(const char* path) { return World::load(*g_ui, path); }
+
+// Appends the chunks changed since the last call to a journal at path, world_load reads both formats.
+bool world_save_delta(const char* path) { return World::save_delta(*g_ui, path); }
+
+// Starts a background save right away, false while another one is still being written.
+bool world_autosave(const char* path) { return World::autosave(*g_ui, path); }
+
+// Autosaves to path every interval seconds from the main loop, 0 turns it off.
+void world_autosave_every(const char* path, F32 seconds) {
+    World::autosave_path = path;
+    World::autosave_interval_us = seconds * 1000000;
+    World::autosave_next = now() + World::autosave_interval_us;
+}
+
 void set_tile(I16 x, I16 y, const char* texture_name, bool ground) { g_ui->set_tile(x, y, texture_name, ground); }
 
+bool set_tiles(const TextureID* ids, I32 count, I16 x, I16 y, I16 width, I16 height) {
+    if (width <= 0 || height <= 0 || count < width * height) {
+        return false;
+    }
+    g_ui->set_tiles(ids, {x, y}, {width, height});
+    return true;
+}
+
+void fill_tiles(I16 x, I16 y, I16 width, I16 height, TextureID id) { g_ui->fill_tiles({x, y}, {width, height}, id); }
+
+// Zero-copy access to a tile layer: row-major TextureIDs, shape is (height, width) and strides are in bytes.
+TextureID* tilemap_layer_ptr(I32 layer) { return g_ui->layer(layer); }
+
+bool tilemap_layer_shape(I32 layer, I32* shape, I32* strides) {
+    if (!g_ui->layer(layer)) {
+        return false;
+    }
+    shape[0] = g_ui->map_size.h;
+    shape[1] = g_ui->map_size.w;
+    strides[0] = g_ui->map_size.w * sizeof(TextureID);
+    strides[1] = sizeof(TextureID);
+    return true;
+}
+
+// To be called after writing to a layer through tilemap_layer_ptr.
+void tilemap_invalidate(I16 x, I16 y, I16 width, I16 height) { g_ui->mark_dirty(g_ui->clip_to_map({x, y}, {width, height})); }
+
+bool tilemap_dirty_region(I16* region) {
+    Box r;
+    if (!g_ui->take_dirty(r)) {
+        return false;
+    }
+    region[0] = r.a.x;
+    region[1] = r.a.y;
+    region[2] = r.b.x - r.a.x;
+    region[3] = r.b.y - r.a.y;
+    return true;
+}
+
 void mapconfig_add_elevation(F32 quantity) { g_ui->map_config->elevations.emplace_back(quantity); }
 
 void mapconfig_add_biome(I16 elevation, const char* name, I16 max_temp, const char* name_wall, I16 max_height, I16 wall_height, bool blocking) {
@@ -1146,10 +4489,117 @@ void mapconfig_set_parameters(I16 num_cells, I16 sample_distance, I16 sample_fac
 
 
 
-void texture_from_bitmap(const char* name, Color* bitmap, I16 width, I16 height) {
+// Frees t and its pixels when the name is taken or the texture ids are used up.
+static bool add_texture(const String& name, Texture* t) {
+    if (g_ui->register_texture(name, t, false)) {
+        return true;
+    }
+    if (t->owns_pixels) {
+        delete[] t->pixels;
+    }
+    delete t;
+    return false;
+}
+
+bool texture_from_bitmap(const char* name, Color* bitmap, I16 width, I16 height) {
     Color* new_bitmap = new Color[width * height];
     std::memcpy(new_bitmap, bitmap, width * height * sizeof(Color));
-    g_ui->register_texture(name, new Texture(new_bitmap, {width, height}), false);
+    return add_texture(name, new Texture(new_bitmap, {width, height}));
+}
+
+// Registers a texture from any row-strided pixel buffer. Native BGRA buffers without row padding can be
+// adopted as is when the caller keeps the memory alive, everything else is converted with a single copy.
+bool texture_from_buffer(const char* name, const U8* data, I16 width, I16 height, I32 stride, PixelFormat format, bool adopt) {
+    int bpp = bytes_per_pixel(format);
+    if (!data || !bpp || width <= 0 || height <= 0 || stride < width * bpp || g_ui->get(name)) {
+        return false;
+    }
+    if (adopt && format == PixelFormat::BGRA8888 && stride == width * bpp && (uintptr_t)data % alignof(Color) == 0) {
+        return add_texture(name, new Texture((Color*)data, {width, height}, false, false));
+    }
+    Color* pixels = new Color[width * height];
+    for (int y = 0; y < height; y++) {
+        convert_row(data + (size_t)y * stride, pixels + y * width, width, format);
+    }
+    return add_texture(name, new Texture(pixels, {width, height}));
+}
+
+static bool load_image(const String& path, Image& image) {
+    Vector<U8> storage;
+    size_t size;
+    const U8* data = g_assets.read(path, storage, size);
+    return data && decode_png(data, size, image);
+}
+
+static bool register_image(const String& name, Image& image) {
+    I32 count = image.size.w * image.size.h;
+    bool transparent = std::any_of(image.pixels.get(), image.pixels.get() + count, [](const Color& c) { return c.alpha < 255; });
+    return add_texture(name, new Texture(image.pixels.release(), image.size, transparent));
+}
+
+// Decodes a PNG file, or the entry of a mounted pack, into texture name.
+bool texture_load(const char* path, const char* name) {
+    Image image;
+    if (g_ui->get(name) || !load_image(path, image)) {
+        return false;
+    }
+    return register_image(name, image);
+}
+
+// Loads every .png below dir, named after the file without its extension. Files are decoded in parallel
+// and registered on the calling thread in path order. Returns the number of textures added.
+I32 texture_load_dir(const char* dir) {
+    std::error_code error;
+    if (!std::filesystem::is_directory(dir, error)) {
+        return 0;
+    }
+    Vector<String> paths;
+    for (const String& path : filelist(dir, ".png")) {
+        if (path.size() > 4 && path.compare(path.size() - 4, 4, ".png") == 0) {
+            paths.push_back(path);
+        }
+    }
+    std::sort(paths.begin(), paths.end());
+    Vector<Image> images(paths.size());
+    Vector<U8> loaded(paths.size());
+    parallel_for(0, paths.size(), [&](int i) {
+        TRACE_ZONE("decode_png");
+        loaded[i] = !g_ui->get(filename(paths[i])) && load_image(paths[i], images[i]);
+    });
+    I32 count = 0;
+    for (size_t i = 0; i < paths.size(); i++) {
+        if (loaded[i] && register_image(filename(paths[i]), images[i])) {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool texture_gen_noise(const char* name, I16 width, I16 height, U32 rgba, F32 variance, U32 seed) {
+    if (width <= 0 || height <= 0 || g_ui->get(name)) {
+        return false;
+    }
+    Color* pixels = new Color[width * height];
+    generate_noise(pixels, {width, height}, Color(rgba), variance, seed);
+    return add_texture(name, new Texture(pixels, {width, height}));
+}
+
+bool texture_gen_box(const char* name, I16 width, I16 height, U32 topleft, U32 botright, U32 border, U32 outborder, I16 border_width) {
+    if (width <= 0 || height <= 0 || g_ui->get(name)) {
+        return false;
+    }
+    Color* pixels = new Color[width * height];
+    generate_box(pixels, {width, height}, Color(topleft), Color(botright), Color(border), Color(outborder), border_width);
+    return add_texture(name, new Texture(pixels, {width, height}));
+}
+
+// Packs the registered textures into atlas pages, returns the number of pages or -1 when out of memory.
+// Call again after registering more textures, earlier pages are repacked.
+I32 texture_atlas_build() { return g_ui->atlas.build(g_ui->id_to_texture); }
+
+TextureID texture_id(const char* name) {
+    Texture* t = g_ui->get(name);
+    return t ? t->id : 0;
 }
 
 bool texture_registered(const char* name) {
@@ -1158,13 +4608,70 @@ bool texture_registered(const char* name) {
 
 
 
+// Packs every file below dir into one archive at path, see AssetPack.
+bool asset_pack_build(const char* dir, const char* path) { return AssetPack::build(dir, path); }
+
+// Later load_sound, load_music and font loads look in the pack first. Packs mounted later win.
+bool asset_pack_mount(const char* path) { return g_assets.mount(path); }
+
 void load_sound(const char* path, const char* name) {
     g_audio->load_wav(path, name, false);
 }
 
+void load_music(const char* path, const char* name) {
+    g_audio->load_wav(path, name, true);
+}
+
+void play_music(const char* name, I32 fade_ms, bool loop) {
+    g_audio->play_music(name, fade_ms, loop);
+}
+
+void stop_music(I32 fade_ms) {
+    g_audio->stop_music(fade_ms);
+}
+
 void play_sound(const char* name) {
     g_audio->play_wav(name, false);
 }
 
+void play_sound_ex(const char* name, F32 gain, F32 pan, I32 priority) {
+    g_audio->play_wav(name, false, gain, pan, priority);
+}
+
+void stop_sound(const char* name) {
+    g_audio->stop_wav(name);
+}
+
+
+
+bool script_run(const char* code) { return script()->run(code, "=script"); }
+
+bool script_run_file(const char* path) { return script()->run_file(path); }
+
+bool script_call(const char* function) { return script()->call_global(function); }
+
+void script_signal(const char* event) { script()->signal(event); }
+
+// Time in microseconds the coroutine scheduler may spend resuming tasks each frame.
+void script_set_budget(I32 budget_us) { script()->budget_us = budget_us; }
+
+// Callback throughput of the ctypes path versus a Lua function, both return the elapsed microseconds.
+long long bench_native_callback(void (*f)(), I32 n) {
+    long long start = now();
+    for (I32 i = 0; i < n; i++) f();
+    return now() - start;
+}
+
+long long bench_script_callback(const char* function, I32 n) {
+    lua_State* L = script()->L;
+    lua_getglobal(L, function);
+    int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    long long start = now();
+    for (I32 i = 0; i < n; i++) script()->call_ref(ref);
+    long long t = now() - start;
+    luaL_unref(L, LUA_REGISTRYINDEX, ref);
+    return t;
+}
+
 
 }
@@ -1,60 +1,68 @@
 from ctypes import *
+import array
 import code
 import struct
 import random
 
+class PixelFormat:
+    BGRA = 0
+    RGBA = 1
+    RGB = 2
+    BGR = 3
+    GRAY = 4
+    _bytes_per_pixel = [4, 4, 3, 3, 1]
+
+_adopted_buffers = {}
+
 class TextureGenerator:
     def _reg_bitmap(name, bitmap, width, height):
-        arr_c = (c_int * len(bitmap))(*bitmap)
-        ENG.texture_from_bitmap(name.encode('utf-8'), arr_c, width, height)
+        TextureGenerator._reg_buffer(name, array.array('i', bitmap), width, height)
+
+    def _reg_buffer(name, buffer, width, height, stride=None, fmt=PixelFormat.BGRA, adopt=False):
+        """Registers a texture from any buffer-protocol object (bytes, bytearray, array, numpy array, memoryview).
+        With adopt=True a tightly packed BGRA buffer is used in place and kept alive here. Returns False if
+        the name is taken or the limit of 32767 (INT16_MAX) registered textures has been reached."""
+        if hasattr(buffer, '__array_interface__'):
+            import numpy
+            buffer = numpy.asarray(buffer)
+            # Rows may be padded, but the pixels of a row must be packed, anything else is copied.
+            if buffer.ndim >= 2 and buffer.strides[0] > 0 and buffer[0].flags['C_CONTIGUOUS']:
+                if stride is None:
+                    stride = buffer.strides[0]
+            else:
+                buffer = numpy.ascontiguousarray(buffer)
+            ptr = buffer.__array_interface__['data'][0]
+        else:
+            view = memoryview(buffer)
+            if view.readonly:
+                if not isinstance(buffer, bytes):
+                    buffer = view.tobytes()
+                ptr = cast(c_char_p(buffer), c_void_p).value
+            else:
+                ptr = addressof((c_char * view.nbytes).from_buffer(view))
+        if stride is None:
+            stride = width * PixelFormat._bytes_per_pixel[fmt]
+        ok = ENG.texture_from_buffer(name.encode('utf-8'), c_void_p(ptr), width, height, stride, fmt, adopt)
+        if ok and adopt:
+            _adopted_buffers[name] = buffer
+        return ok
 
     def box(width, height):
         t_name = "box_"+str(width)+"_"+str(height)
         if not ENG.texture_registered(t_name):
-            bitmap = []
             color_topleft = Color(0, 0, 150)
             color_botright = Color(0, 0, 32)
             color_border = Color(180, 180, 180)
             color_outborder = color_border.copy()
             color_outborder.sub(80)
             border_width = 6
-            bw = border_width
-            d1 = 0.25 * border_width;
-            d2 = 0.75 * border_width;
-            d3 = border_width;
-            max_dist = width + height - 2
-            for y in range(height):
-                for x in range(width):
-                    if x < d1 or x > width - d1 - 1 or y < d1 or y > height - d1 - 1:
-                        bitmap.append(color_outborder.pack()) 
-                    elif (x >= d1 and x <= d2) or (x >= width - d2) or (y >= d1 and y <= d2) or (y >= height - d2): 
-                        bitmap.append(color_border.pack()) 
-                    elif (x > d2 and x < bw) or (x < width - d2 and x > width - bw - 1) or (y > d2 and y < bw) or (y < height - d2 and y > height - bw - 1):
-                        bitmap.append(color_outborder.pack()) 
-                    else:
-                        p_topleft = 1 - (x + y) / max_dist 
-                        p_botright = 1 - (width - x + height + y) / max_dist 
-                        c = Color(0, 0, 0, 255)
-                        c.red = p_topleft * color_topleft.red + p_botright * color_botright.red
-                        c.green = p_topleft * color_topleft.green + p_botright * color_botright.green
-                        c.blue = p_topleft * color_topleft.blue + p_botright * color_botright.blue
-                        c._correct()
-                        bitmap.append(c.pack())
-            TextureGenerator._reg_bitmap(t_name, bitmap, width, height)
+            ENG.texture_gen_box(t_name.encode('utf-8'), width, height, color_topleft.pack(), color_botright.pack(),
+                                color_border.pack(), color_outborder.pack(), border_width)
         return t_name
 
     def noise(name, width, height, color, variance):
         if not ENG.texture_registered(name):
-            bitmap = []
-            for i in range(height * width):
-                c = color.copy()
-                g = random.gauss(0, variance)
-                if g < 0:
-                    c.sub(255 * -g)
-                else:
-                    c.add(255 * g)
-                bitmap.append(c.pack())
-            TextureGenerator._reg_bitmap(name, bitmap, width, height)
+            ENG.texture_gen_noise(name.encode('utf-8'), width, height, color.pack(), variance, random.getrandbits(32))
         return name
 
 class Color:
@@ -84,13 +92,31 @@ class Color:
         self.blue = min(255, max(0, int(self.blue)))
         self.alpha = min(255, max(0, int(self.alpha)))
 
+class ProfileStats(Structure):
+    _fields_ = [("last", c_float), ("min", c_float), ("avg", c_float), ("p99", c_float), ("max", c_float)]
+
 class Engine:
-    def init(width, height):
+    def init(width, height, headless=False):
         global ENG 
         ENG = cdll.LoadLibrary("./libEngine.so")
         ENG.texture_from_bitmap.argtypes = [c_char_p, POINTER(c_int), c_int, c_int]
+        ENG.texture_from_bitmap.restype = c_bool
         ENG.texture_registered.restype = c_bool
-        ENG.init(width, height)
+        ENG.texture_from_buffer.argtypes = [c_char_p, c_void_p, c_int, c_int, c_int, c_int, c_bool]
+        ENG.texture_from_buffer.restype = c_bool
+        ENG.texture_gen_box.argtypes = [c_char_p, c_int, c_int, c_uint, c_uint, c_uint, c_uint, c_int]
+        ENG.texture_id.restype = c_short
+        ENG.set_tiles.restype = c_bool
+        ENG.tilemap_layer_ptr.restype = c_void_p
+        ENG.tilemap_layer_shape.restype = c_bool
+        ENG.tilemap_dirty_region.restype = c_bool
+        ENG.texture_gen_noise.argtypes = [c_char_p, c_int, c_int, c_uint, c_float, c_uint]
+        ENG.framebuffer_ptr.restype = c_void_p
+        ENG.save_frame.restype = c_bool
+        if headless:
+            ENG.init_headless(width, height)
+        else:
+            ENG.init(width, height)
         global _screen_width
         global _screen_height
         _screen_width = width
@@ -111,11 +137,111 @@ class Engine:
     def run():
         ENG.run()
 
+    def render_frame():
+        ENG.render_frame()
+
+    def framebuffer():
+        """Live (height, width) view of the BGRA frame as uint32, for comparing frames pixel by pixel."""
+        arr = (c_uint * (_screen_width * _screen_height)).from_address(ENG.framebuffer_ptr())
+        return memoryview(arr).cast('B').cast('I', (_screen_height, _screen_width))
+
+    def save_frame(path):
+        return ENG.save_frame(path.encode('utf-8'))
+
+    def set_seed(seed):
+        ENG.set_seed(c_uint(seed))
+
+    def record_input(path):
+        ENG.input_record.restype = c_bool
+        return ENG.input_record(path.encode('utf-8'))
+
+    FRAME_UNCAPPED = 0
+    FRAME_VSYNC = -1
+
+    def set_tick_rate(hz):
+        ENG.set_tick_rate(int(hz))
+
+    def set_frame_limit(fps):
+        ENG.set_frame_limit(int(fps))
+
+    PROFILE_STAGES = ["frame", "input", "widgets", "tilemap", "text", "present", "mapgen"]
+
+    def profiler_stats():
+        """Returns {stage: ProfileStats} in milliseconds over the last frames."""
+        stats = {}
+        for i, name in enumerate(Engine.PROFILE_STAGES):
+            s = ProfileStats()
+            ENG.profiler_get_stats(i, byref(s))
+            stats[name] = s
+        return stats
+
+    def autosave_status():
+        """Returns (running, progress 0..1, duration of the last autosave in ms)."""
+        progress = c_float()
+        last_ms = c_float()
+        ENG.profiler_get_autosave.restype = c_bool
+        running = ENG.profiler_get_autosave(byref(progress), byref(last_ms))
+        return (running, progress.value, last_ms.value)
+
+    def show_profiler(show=True):
+        ENG.profiler_show(show)
+
+    def trace_begin():
+        ENG.trace_begin()
+
+    def trace_end():
+        ENG.trace_end()
+
+    def trace_export(path):
+        ENG.trace_export.restype = c_bool
+        return ENG.trace_export(path.encode('utf-8'))
+
+    def stop_recording():
+        ENG.input_record_stop()
+
+    def replay_input(path, exit_at_end=True):
+        ENG.input_replay.restype = c_bool
+        return ENG.input_replay(path.encode('utf-8'), exit_at_end)
+
+    def mount_pack(path):
+        """Sounds, music and fonts are looked up in the pack before the file system, see Pack.py."""
+        ENG.asset_pack_mount.restype = c_bool
+        return ENG.asset_pack_mount(path.encode('utf-8'))
+
+    def load_texture(path, name):
+        """Decodes a PNG into a texture, False if name is taken, the file is not a supported PNG or the
+        32767 texture limit has been reached."""
+        ENG.texture_load.restype = c_bool
+        return ENG.texture_load(path.encode('utf-8'), name.encode('utf-8'))
+
+    def build_atlas():
+        """Packs the registered textures into a few shared pages so tile drawing stays in cache. Textures
+        registered afterwards work as before, calling it again repacks everything. Returns the number of
+        pages, -1 if they could not be allocated, in which case the textures are left as they were."""
+        return ENG.texture_atlas_build()
+
+    def load_textures(directory):
+        """Loads every .png below directory in parallel, textures are named after the file name without
+        extension. Returns the number of textures added."""
+        return ENG.texture_load_dir(directory.encode('utf-8'))
+
     def load_sound(path, name):
         ENG.load_sound(path.encode('utf-8'), name.encode('utf-8'))
     
-    def play_sound(name):
-        ENG.play_sound(name.encode('utf-8'))
+    def load_music(path, name):
+        ENG.load_music(path.encode('utf-8'), name.encode('utf-8'))
+
+    def play_music(name, fade_ms=0, loop=True):
+        ENG.play_music(name.encode('utf-8'), int(fade_ms), loop)
+
+    def stop_music(fade_ms=0):
+        ENG.stop_music(int(fade_ms))
+
+    def play_sound(name, gain=1.0, pan=0.0, priority=0):
+        ENG.play_sound_ex(name.encode('utf-8'), c_float(gain), c_float(pan), priority)
+
+    def stop_sound(name):
+        ENG.stop_sound(name.encode('utf-8'))
 
     class UIElement:
         def __init__(self, width, height):
@@ -136,6 +262,10 @@ class Engine:
             CBFUNC = CFUNCTYPE(c_void_p)
             self._cb = CBFUNC(cb) 
             ENG.set_widget_callback(self._ptr, self._cb)
+        def _set_hover_callback(self, cb):
+            CBFUNC = CFUNCTYPE(c_void_p)
+            self._hover_cb = CBFUNC(cb) 
+            ENG.set_widget_hover_callback(self._ptr, self._hover_cb)
         def width(self):
             return self._width
         def height(self):
@@ -171,6 +301,46 @@ class TilemapWidget(GameWidget):
         self._set_parent(parent, offset_x, offset_y)
     def set_tile(self, x, y, texture_name, ground=False):
         ENG.set_tile(x, y, texture_name.encode('utf-8'), ground)
+    def pick(self, x, y):
+        packed = ENG.tilemap_pick(int(x), int(y))
+        if packed == -1:
+            return None
+        return (packed & 0xFFFF, packed >> 16)
+    def pick_rect(self, x0, y0, x1, y1, out=None):
+        if out is None:
+            out = (c_int * ENG.tilemap_pick_rect(int(x0), int(y0), int(x1), int(y1), None, 0))()
+        count = ENG.tilemap_pick_rect(int(x0), int(y0), int(x1), int(y1), out, len(out))
+        return out[:min(count, len(out))]
+    def texture_id(self, texture_name):
+        return ENG.texture_id(texture_name.encode('utf-8'))
+    def set_tiles(self, x, y, width, height, ids):
+        """ids: row-major sequence or int16 buffer of width*height texture ids from texture_id()"""
+        if not isinstance(ids, array.array) or ids.typecode != 'h':
+            ids = array.array('h', ids)
+        ptr, count = ids.buffer_info()
+        return ENG.set_tiles(c_void_p(ptr), count, int(x), int(y), int(width), int(height))
+    def fill_tiles(self, x, y, width, height, texture):
+        if isinstance(texture, str):
+            texture = self.texture_id(texture)
+        ENG.fill_tiles(int(x), int(y), int(width), int(height), texture)
+    def layer(self, layer=0):
+        """Live (height, width) int16 view of a tile layer without copying, numpy.asarray() accepts it as well.
+        Call invalidate() after bulk writes."""
+        shape = (c_int * 2)()
+        strides = (c_int * 2)()
+        if not ENG.tilemap_layer_shape(layer, shape, strides):
+            return None
+        arr = (c_short * (shape[0] * shape[1])).from_address(ENG.tilemap_layer_ptr(layer))
+        return memoryview(arr).cast('B').cast('h', (shape[0], shape[1]))
+    def invalidate(self, x=0, y=0, width=None, height=None):
+        width = 0x7FFF if width is None else width
+        height = 0x7FFF if height is None else height
+        ENG.tilemap_invalidate(int(x), int(y), int(width), int(height))
+    def dirty_region(self):
+        region = (c_short * 4)()
+        if not ENG.tilemap_dirty_region(region):
+            return None
+        return tuple(region)
     def move_camera(self, x_amount, y_amount):
         ENG.tilemap_move(x_amount, y_amount)
     def zoomin(self):
@@ -189,4 +359,22 @@ class TilemapWidget(GameWidget):
     def _cfg_set_parameters(self, num_cells, sample_distance, sample_factor):
         ENG.mapconfig_set_parameters(num_cells, sample_distance, sample_factor)
     def _randomize_map(self):
-        ENG.tilemap_randomize()
\ No newline at end of file
+        ENG.tilemap_randomize()
+    def save(self, path):
+        ENG.world_save.restype = c_bool
+        return ENG.world_save(path.encode('utf-8'))
+    def load(self, path):
+        """Replaces map config, seed and tiles with a saved world, the map may change size."""
+        ENG.world_load.restype = c_bool
+        return ENG.world_load(path.encode('utf-8'))
+    def save_delta(self, path):
+        """Appends the chunks changed since the last save_delta() to a journal, load() reads it back by
+        regenerating the map from its seed. Much cheaper than save() when only a few tiles changed."""
+        ENG.world_save_delta.restype = c_bool
+        return ENG.world_save_delta(path.encode('utf-8'))
+    def autosave(self, path):
+        """Writes the world on a background thread from a copy-on-write snapshot."""
+        ENG.world_autosave.restype = c_bool
+        return ENG.world_autosave(path.encode('utf-8'))
+    def autosave_every(self, path, seconds):
+        ENG.world_autosave_every(path.encode('utf-8'), c_float(seconds))
\ No newline at end of file
@@ -1,5 +1,8 @@
 from Engine import *
 
+SAVE_PATH = "./world.sav"
+AUTOSAVE_PATH = "./autosave.sav"
+
 class Map:
     class Config:
         class Biome:
@@ -37,7 +40,7 @@ class Map:
             self._sample_factor = sample_factor
             self._sample_distance = sample_distance
 
-    def create(mapconfig:Config, width, height, parent, xpos, ypos):
+    def create(mapconfig:Config, width, height, parent, xpos, ypos, save_path=None):
         global _map
         _map = TilemapWidget(width, height, mapconfig._map_size, mapconfig._map_size, 
                             mapconfig._tile_size, mapconfig._tile_size, parent, xpos, ypos)
@@ -52,7 +55,8 @@ class Map:
                     _map._cfg_add_vegetation(elev_idx, biome._name, vegetation[0], vegetation[1])
             elev_idx += 1
 
-        _map._randomize_map()
+        if save_path is None or not _map.load(save_path):
+            _map._randomize_map()
         accel = 10
         Engine.bind_key("Up", lambda: _map.move_camera(0, -accel))
         Engine.bind_key("Down", lambda: _map.move_camera(0, accel))
@@ -60,6 +64,8 @@ class Map:
         Engine.bind_key("Right", lambda: _map.move_camera(accel, 0))
         Engine.bind_key("WheelDown", lambda: _map.zoomout())
         Engine.bind_key("WheelUp", lambda: _map.zoomin())
+        Engine.bind_key("F5", lambda: _map.save_delta(SAVE_PATH))
+        _map.autosave_every(AUTOSAVE_PATH, 120)
 
 class Hud:
     class Menu:
@@ -90,10 +96,10 @@ def create_map_config(map_size, tile_size):
     cfg.add_elevation_level(quantity=0.2925).add_biome("earth", name_wall="mountain_wall", max_height=32, wall_height=2)
     return cfg
 
-def init_ingame():
+def init_ingame(save_path=None):
     map_size = 1024
     tile_size = 16
     hud_width = 0.3
     config = create_map_config(map_size, tile_size)
-    Map.create(config, (1-hud_width)*Engine.screen_width(), Engine.screen_height(), None, hud_width*Engine.screen_width(), 0) 
+    Map.create(config, (1-hud_width)*Engine.screen_width(), Engine.screen_height(), None, hud_width*Engine.screen_width(), 0, save_path)
     Hud.create(hud_width*Engine.screen_width(), Engine.screen_height(), None, 0, 0) 
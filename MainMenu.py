@@ -1,7 +1,13 @@
 from Engine import *
-from Game import init_ingame
+from Game import init_ingame, SAVE_PATH, AUTOSAVE_PATH
+import os
+
+PACK_PATH = "./assets.pak"
 
 def init_assets():
+    if os.path.exists(PACK_PATH):
+        Engine.mount_pack(PACK_PATH)
+
     # Textures
     dim = 16
     TextureGenerator.noise("water", dim, dim, Color(0, 72, 200), 0.04)
@@ -13,6 +19,8 @@ def init_assets():
     TextureGenerator.noise("mountain", dim, dim, Color(175, 127, 64), 0.03)
     TextureGenerator.noise("mountain_wall", dim, dim, Color(104, 64, 32), 0.1)
 
+    Engine.build_atlas()
+
     # Audio
     Engine.load_sound("./click.wav", "click")
 
@@ -32,9 +40,16 @@ class MainMenu(GameWidget):
     class LoadButton(GameButton):
         def __init__(self, width, height, parent, off_x, off_y):
             super().__init__(width, height, "Load Game", parent, off_x, off_y, self.on_click)
+            self._parent = parent
         def on_click(self):
             super().on_click()
+            saves = [p for p in (SAVE_PATH, AUTOSAVE_PATH) if os.path.exists(p)]
+            if not saves:
+                print("no saved game")
+                return
             print("load game!")
+            self._parent.remove()
+            init_ingame(max(saves, key=os.path.getmtime))
     
     class OptionsButton(GameButton):
         def __init__(self, width, height, parent, off_x, off_y):
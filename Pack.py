@@ -0,0 +1,18 @@
+from ctypes import *
+import sys
+
+# Packs the files below a directory into one archive that Engine.mount_pack() maps at startup.
+# Names in the pack are paths relative to the directory, so pack the directory the game loads from:
+#   python3 Pack.py . assets.pak
+
+def main(directory, path):
+    eng = cdll.LoadLibrary("./libEngine.so")
+    eng.asset_pack_build.restype = c_bool
+    if not eng.asset_pack_build(directory.encode('utf-8'), path.encode('utf-8')):
+        print("packing %s failed" % directory)
+        sys.exit(1)
+
+if len(sys.argv) != 3:
+    print("usage: python3 Pack.py <directory> <pack>")
+    sys.exit(1)
+main(sys.argv[1], sys.argv[2])
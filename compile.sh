@@ -1 +1,2 @@
-g++ -Wall -O0 -g3 -fPIC -std=c++17 Engine.cpp -shared -lSDL2 -o libEngine.so 
+g++ -Wall -O0 -g3 -fPIC -std=c++17 -pthread Engine.cpp -x c++ extern/lua/onelua.c -shared -lSDL2 -o libEngine.so 
+g++ -Wall -O2 -fno-strict-aliasing -std=c++17 -pthread Benchmark.cpp -x c++ extern/lua/onelua.c -lSDL2 -o benchmark
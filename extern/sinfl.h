@@ -405,12 +405,14 @@ sinfl_decompress(unsigned char *out, int cap, const unsigned char *in, int size)
       sinfl__get(&s,s.bitcnt & 7);
       len = sinfl__get(&s,16);
       nlen = sinfl__get(&s,16);
-      in -= 2; s.bitcnt = 0;
+      s.bitptr -= s.bitcnt / 8;
+      s.bitbuf = s.bitcnt = 0;
 
-      if (len > (e-in) || !len)
+      if (len != (~nlen & 0xffff) || len > (e-s.bitptr) || len > (oe-out))
         return (int)(out-o);
-      memcpy(out, in, (size_t)len);
-      in += len, out += len;
+      memcpy(out, s.bitptr, (size_t)len);
+      s.bitptr += len, out += len;
+      if (last) return (int)(out-o);
       state = hdr;
     } break;
     case fixed: {